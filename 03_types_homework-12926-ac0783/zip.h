@@ -0,0 +1,51 @@
+#ifndef ZIP_H
+#define ZIP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef size_t zipiter_t; /* Zip archive member iterator. */
+
+typedef struct zip_t zip_t;
+struct zip_t {
+    uint16_t num_members;    /* Number of members. */
+    const uint8_t *comment;  /* Zip file comment (not terminated). */
+    uint16_t comment_len;    /* Zip file comment length. */
+    zipiter_t members_begin; /* Iterator to the first member. */
+    zipiter_t members_end;   /* Iterator to the end of members. */
+
+    const uint8_t *src;
+    size_t src_len;
+    size_t offset;           /* Сдвиг архива от начала файла. */
+};
+
+
+typedef enum { ZIP_STORED = 0, ZIP_DEFLATED = 8 } method_t;
+
+typedef struct zipmemb_t zipmemb_t;
+struct zipmemb_t {
+    const uint8_t *name;      /* Member name (not null terminated). */
+    uint16_t name_len;        /* Member name length. */
+    time_t mtime;             /* Modification time. */
+    uint32_t comp_size;       /* Compressed size. */
+    const uint8_t *comp_data; /* Compressed data. */
+    method_t method;          /* Compression method. */
+    uint32_t uncomp_size;     /* Uncompressed size. */
+    uint32_t crc32;           /* CRC-32 checksum. */
+    const uint8_t *comment;   /* Comment (not null terminated). */
+    uint16_t comment_len;     /* Comment length. */
+    bool is_dir;              /* Whether this is a directory. */
+    zipiter_t next;           /* Iterator to the next member. */
+};
+
+/* Initialize zip based on the source data. Returns true on success, or false
+   if the data could not be parsed as a valid Zip file. Архив может быть
+   дописан в конец другого файла, его сдвиг сохраняется в zip->offset. */
+bool zip_read(zip_t *zip, const uint8_t *src, size_t src_len);
+
+/* Get the Zip archive member through iterator it. */
+zipmemb_t zip_member(const zip_t *zip, zipiter_t it);
+
+#endif /* ZIP_H */
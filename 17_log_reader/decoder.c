@@ -0,0 +1,226 @@
+#include "decoder.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define GZ_BUFFER_SIZE (128 * 1024) /* внутренний буфер zlib для чтения */
+
+struct decoder {
+    enum log_format format;
+    char *path;
+#ifdef HAVE_ZLIB
+    gzFile gz;
+#endif
+#ifdef HAVE_ZSTD
+    FILE *file;
+    ZSTD_DStream *zs;
+    char *in_buf;
+    size_t in_cap;
+    ZSTD_inBuffer in;
+    bool eof;
+    size_t last_ret; /* 0, если последний кадр дочитан до конца */
+#endif
+};
+
+static bool has_suffix(const char *name, const char *suffix) {
+    const size_t len = strlen(name);
+    const size_t slen = strlen(suffix);
+    return len > slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+enum log_format log_format(const char *name) {
+    if (has_suffix(name, ".gz"))
+        return LOG_GZIP;
+    if (has_suffix(name, ".zst"))
+        return LOG_ZSTD;
+    return LOG_PLAIN;
+}
+
+size_t log_compressed_suffix(const char *name) {
+    switch (log_format(name)) {
+    case LOG_GZIP: return 3;
+    case LOG_ZSTD: return 4;
+    default: return 0;
+    }
+}
+
+bool decoder_supported(enum log_format format) {
+    switch (format) {
+    case LOG_PLAIN:
+        return true;
+    case LOG_GZIP:
+#ifdef HAVE_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case LOG_ZSTD:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+#ifdef HAVE_ZLIB
+static int gzip_open(struct decoder *d) {
+    d->gz = gzopen(d->path, "rb");
+    if (!d->gz) {
+        perror(d->path);
+        return -1;
+    }
+    gzbuffer(d->gz, GZ_BUFFER_SIZE);
+    return 0;
+}
+
+static ssize_t gzip_read(struct decoder *d, char *buf, size_t cap) {
+    if (cap > INT_MAX)
+        cap = INT_MAX;
+    const int n = gzread(d->gz, buf, (unsigned)cap);
+    int err = Z_OK;
+    const char *msg = n <= 0 ? gzerror(d->gz, &err) : NULL;
+    /* обрезанный файл: gzread отдаёт всё, что смог, затем 0 и Z_BUF_ERROR */
+    if (n < 0 || err != Z_OK) {
+        /* сообщение zlib уже начинается с имени файла */
+        if (err == Z_ERRNO)
+            perror(d->path);
+        else
+            fprintf(stderr, "%s\n", msg);
+        return -1;
+    }
+    return n;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int zstd_open(struct decoder *d) {
+    d->file = fopen(d->path, "rb");
+    if (!d->file) {
+        perror(d->path);
+        return -1;
+    }
+    d->zs = ZSTD_createDStream();
+    d->in_cap = ZSTD_DStreamInSize();
+    d->in_buf = malloc(d->in_cap);
+    if (!d->zs || !d->in_buf || ZSTD_isError(ZSTD_initDStream(d->zs))) {
+        fprintf(stderr, "%s: не удалось начать распаковку zstd\n", d->path);
+        return -1;
+    }
+    d->in.src = d->in_buf;
+    return 0;
+}
+
+/**
+ * Распаковка zstd: входной буфер дочитывается из файла по мере расхода,
+ * после конца файла декодер ещё вызывается, пока отдаёт данные
+ * @param d
+ * @param buf
+ * @param cap
+ * @return
+ */
+static ssize_t zstd_read(struct decoder *d, char *buf, size_t cap) {
+    ZSTD_outBuffer out = { buf, cap, 0 };
+    while (out.pos < out.size) {
+        if (d->in.pos == d->in.size && !d->eof) {
+            const size_t n = fread(d->in_buf, 1, d->in_cap, d->file);
+            if (n == 0) {
+                if (ferror(d->file)) {
+                    perror(d->path);
+                    return -1;
+                }
+                d->eof = true;
+            }
+            d->in.size = n;
+            d->in.pos = 0;
+        }
+        const size_t out_before = out.pos;
+        const size_t in_before = d->in.pos;
+        const size_t ret = ZSTD_decompressStream(d->zs, &out, &d->in);
+        if (ZSTD_isError(ret)) {
+            fprintf(stderr, "%s: %s\n", d->path, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        const bool progress = out.pos != out_before || d->in.pos != in_before;
+        /* вызов без входа и выхода после конца кадра тоже вернёт не 0 */
+        if (progress)
+            d->last_ret = ret;
+        else if (d->eof)
+            break;
+    }
+    if (out.pos == 0 && d->last_ret != 0) {
+        fprintf(stderr, "%s: файл обрезан\n", d->path);
+        return -1;
+    }
+    return (ssize_t)out.pos;
+}
+#endif
+
+struct decoder *decoder_open(const char *path, enum log_format format) {
+    if (!decoder_supported(format) || format == LOG_PLAIN) {
+        fprintf(stderr, "%s: формат не поддерживается этой сборкой\n", path);
+        return NULL;
+    }
+    struct decoder *d = calloc(1, sizeof(*d));
+    if (!d || !(d->path = strdup(path))) {
+        perror("decoder_open");
+        free(d);
+        return NULL;
+    }
+    d->format = format;
+    int ret = -1;
+#ifdef HAVE_ZLIB
+    if (format == LOG_GZIP)
+        ret = gzip_open(d);
+#endif
+#ifdef HAVE_ZSTD
+    if (format == LOG_ZSTD)
+        ret = zstd_open(d);
+#endif
+    if (ret == -1) {
+        decoder_close(d);
+        return NULL;
+    }
+    return d;
+}
+
+ssize_t decoder_read(struct decoder *decoder, char *buf, size_t cap) {
+#ifdef HAVE_ZLIB
+    if (decoder->format == LOG_GZIP)
+        return gzip_read(decoder, buf, cap);
+#endif
+#ifdef HAVE_ZSTD
+    if (decoder->format == LOG_ZSTD)
+        return zstd_read(decoder, buf, cap);
+#endif
+    (void)decoder;
+    (void)buf;
+    (void)cap;
+    return -1;
+}
+
+void decoder_close(struct decoder *decoder) {
+    if (!decoder)
+        return;
+#ifdef HAVE_ZLIB
+    if (decoder->gz)
+        gzclose(decoder->gz);
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeDStream(decoder->zs);
+    free(decoder->in_buf);
+    if (decoder->file)
+        fclose(decoder->file);
+#endif
+    free(decoder->path);
+    free(decoder);
+}
@@ -0,0 +1,62 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Формат лог-файла по суффиксу имени */
+enum log_format {
+    LOG_PLAIN,
+    LOG_GZIP, /* .gz */
+    LOG_ZSTD /* .zst */
+};
+
+/* Потоковая распаковка одного файла */
+struct decoder;
+
+/**
+ * Формат по имени файла: .gz и .zst — сжатые, остальное — обычный текст
+ * @param name
+ * @return
+ */
+enum log_format log_format(const char *name);
+
+/**
+ * Длина суффикса сжатия (.gz или .zst) в конце имени
+ * @param name
+ * @return 0 для несжатых
+ */
+size_t log_compressed_suffix(const char *name);
+
+/**
+ * Собрана ли программа с поддержкой формата (zlib, zstd)
+ * @param format
+ * @return
+ */
+bool decoder_supported(enum log_format format);
+
+/**
+ * Открытие сжатого файла
+ * @param path
+ * @param format LOG_GZIP или LOG_ZSTD
+ * @return NULL при ошибке, сообщение уже выведено
+ */
+struct decoder *decoder_open(const char *path, enum log_format format);
+
+/**
+ * Распаковка следующей порции в buf
+ * @param decoder
+ * @param buf
+ * @param cap
+ * @return число байт, 0 в конце файла, -1 при ошибке (сообщение выведено)
+ */
+ssize_t decoder_read(struct decoder *decoder, char *buf, size_t cap);
+
+/**
+ * Закрытие файла и освобождение состояния распаковки
+ * @param decoder
+ */
+void decoder_close(struct decoder *decoder);
+
+#endif /* DECODER_H */
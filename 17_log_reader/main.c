@@ -3,179 +3,260 @@
 #include <string.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <getopt.h>
 
-#define MAX_LINE_LEN 8192
-#define HASH_SIZE 1024
-#define TOP_N 10
+#include "decoder.h"
 
-typedef struct UrlEntry {
-    char *key;
-    size_t bytes;
-    struct UrlEntry *next;
-} UrlEntry;
+#define CHUNK_SIZE (4 * 1024 * 1024)
+#define DECODE_BUFFER_SIZE (1024 * 1024) /* порция распакованных строк */
+#define HASH_SIZE 1024 /* начальный размер таблиц, степень двойки */
+#define TOP_N 10 /* размер топа по умолчанию, меняется ключом -n */
+#define CACHE_LINE 64 /* выравнивание состояний потоков */
+#define MAX_TOP_N 1000000 /* предел для -n */
 
+/* Слот таблицы: полный хеш, длина и смещение ключа в арене. Хеш
+ * сравнивается первым, так что байты ключа читаются почти только при
+ * совпадении. hash == 0 означает пустой слот */
 typedef struct {
-    pthread_mutex_t mutex;
-    UrlEntry **buckets;
+    uint64_t hash;
+    size_t key_off;
+    size_t key_len;
+    size_t value;
+} CountSlot;
+
+/* Таблица с открытой адресацией и линейным пробированием: ключ -> сумма.
+ * Ключи лежат подряд в арене, таблица растёт вдвое при заполнении 3/4 */
+typedef struct {
+    CountSlot *slots;
+    size_t mask;
+    size_t count;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+} CountMap;
+
+/* Участок строки без копирования и без завершающего нуля */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} StrView;
+
+/* Файл лога, отображённый в память */
+typedef struct {
+    char *data;
     size_t size;
-} UrlMap;
+} MappedFile;
 
-typedef struct RefEntry {
-    char *key;
-    int count;
-    struct RefEntry *next;
-} RefEntry;
+/* Буфер распакованных данных, после разбора возвращается в пул */
+typedef struct Buffer {
+    char *data;
+    struct Buffer *next;
+} Buffer;
 
+/* Пул буферов распаковки. Их число ограничено, поэтому распаковка не
+ * уходит далеко вперёд разбора и память не растёт */
 typedef struct {
     pthread_mutex_t mutex;
-    RefEntry **buckets;
-    size_t size;
-} RefMap;
+    pthread_cond_t cond;
+    Buffer *free;
+} BufferPool;
 
+/* Часть файла из целых строк. buffer == NULL у частей отображённых
+ * файлов, иначе часть лежит в буфере распаковки */
+typedef struct {
+    const char *data;
+    size_t len;
+    Buffer *buffer;
+} Chunk;
+
+/* Части всех файлов и позиция следующей необработанной. Потоки берут
+ * части, а не файлы, так что даже один большой файл делится между всеми.
+ * Части сжатых файлов добавляются по ходу работы потоками распаковки,
+ * пока они работают (producers > 0), пустая очередь не означает конец */
 typedef struct {
     pthread_mutex_t mutex;
     pthread_cond_t cond;
-    char **files;
+    Chunk *chunks;
+    size_t count;
+    size_t capacity;
+    size_t next;
+    int producers;
+    BufferPool *pool;
+} ChunkQueue;
+
+/* Сжатые файлы, которые разбирают потоки распаковки */
+typedef struct {
+    ChunkQueue *queue;
+    char **paths;
     int count;
-    int next;
-    int finished;
-} FileQueue;
+    int next; /* под mutex очереди */
+} DecodeJobs;
+
+/* Собственные таблицы и счётчик потока. Во время разбора потоки ничего
+ * общего не пишут, таблицы сливаются в одну после pthread_join.
+ * Каждое состояние выровнено по строке кэша, чтобы соседние в массиве
+ * не делили её */
+typedef struct {
+    _Alignas(CACHE_LINE) ChunkQueue *queue;
+    CountMap url_map;
+    CountMap ref_map;
+    size_t total_bytes;
+} WorkerState;
 
-static UrlMap url_map;
-static RefMap ref_map;
-static size_t total_bytes = 0;
-static pthread_mutex_t total_bytes_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Пара состояний для одного шага слияния */
+typedef struct {
+    WorkerState *dst;
+    WorkerState *src;
+} MergeJob;
 
 
 void cleanup(void) {
     printf("[INFO] Освобождаются выделенные ресурсы\n");
 }
 
-static unsigned long hash(const char *str) {
-    unsigned long h = 5381;
-    int c;
-    while ((c = *str++))
-        h = ((h << 5) + h) + c;
-    return h;
+/**
+ * 64-битный FNV-1a. Ноль зарезервирован под пустой слот
+ * @param key
+ * @param len
+ * @return
+ */
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
 }
 
-static void url_map_init(UrlMap *map, size_t size) {
-    map->buckets = calloc(size, sizeof(UrlEntry*));
-    if (!map->buckets) {
-        perror("url_map_init: calloc");
+static void count_map_init(CountMap *map, size_t size) {
+    map->slots = calloc(size, sizeof(CountSlot));
+    if (!map->slots) {
+        perror("count_map_init: calloc");
         exit(EXIT_FAILURE);
     }
-    map->size = size;
-    pthread_mutex_init(&map->mutex, NULL);
+    map->mask = size - 1;
+    map->count = 0;
+    map->arena = NULL;
+    map->arena_len = 0;
+    map->arena_cap = 0;
 }
 
-static void ref_map_init(RefMap *map, size_t size) {
-    map->buckets = calloc(size, sizeof(RefEntry*));
-    if (!map->buckets) {
-        perror("ref_map_init: calloc");
+/**
+ * Увеличение таблицы вдвое. Слоты переносятся по сохранённому хешу,
+ * ключи не читаются
+ * @param map
+ */
+static void count_map_grow(CountMap *map) {
+    size_t size = (map->mask + 1) * 2;
+    CountSlot *slots = calloc(size, sizeof(CountSlot));
+    if (!slots) {
+        perror("count_map_grow: calloc");
         exit(EXIT_FAILURE);
     }
-    map->size = size;
-    pthread_mutex_init(&map->mutex, NULL);
+    for (size_t i = 0; i <= map->mask; i++) {
+        const CountSlot *s = &map->slots[i];
+        if (s->hash == 0)
+            continue;
+        size_t j = s->hash & (size - 1);
+        while (slots[j].hash != 0)
+            j = (j + 1) & (size - 1);
+        slots[j] = *s;
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->mask = size - 1;
 }
 
-static void url_map_add(UrlMap *map, const char *key, size_t bytes) {
-    if (!key || bytes == 0) return;
-    unsigned long h = hash(key) % map->size;
-    pthread_mutex_lock(&map->mutex);
-    UrlEntry *e = map->buckets[h];
-    while (e) {
-        if (strcmp(e->key, key) == 0) {
-            e->bytes += bytes;
-            pthread_mutex_unlock(&map->mutex);
-            return;
+/**
+ * Копирование ключа в арену, с завершающим нулём для вывода
+ * @param map
+ * @param key
+ * @param len
+ * @return смещение ключа
+ */
+static size_t arena_store(CountMap *map, const char *key, size_t len) {
+    if (map->arena_len + len + 1 > map->arena_cap) {
+        size_t cap = map->arena_cap ? map->arena_cap * 2 : 64 * 1024;
+        while (cap < map->arena_len + len + 1)
+            cap *= 2;
+        char *tmp = realloc(map->arena, cap);
+        if (!tmp) {
+            perror("arena_store: realloc");
+            exit(EXIT_FAILURE);
         }
-        e = e->next;
-    }
-    UrlEntry *new_e = malloc(sizeof(UrlEntry));
-    if (!new_e) {
-        perror("url_map_add: malloc UrlEntry");
-        pthread_mutex_unlock(&map->mutex);
-        exit(EXIT_FAILURE);
-    }
-    new_e->key = malloc(strlen(key) + 1);
-    if (!new_e->key) {
-        perror("url_map_add: malloc key");
-        free(new_e);
-        pthread_mutex_unlock(&map->mutex);
-        exit(EXIT_FAILURE);
+        map->arena = tmp;
+        map->arena_cap = cap;
     }
-    strcpy(new_e->key, key);
-    new_e->bytes = bytes;
-    new_e->next = map->buckets[h];
-    map->buckets[h] = new_e;
-    pthread_mutex_unlock(&map->mutex);
-}
-
-static void ref_map_inc(RefMap *map, const char *key) {
-    if (!key) return;
-    unsigned long h = hash(key) % map->size;
-    pthread_mutex_lock(&map->mutex);
-    RefEntry *e = map->buckets[h];
-    while (e) {
-        if (strcmp(e->key, key) == 0) {
-            e->count++;
-            pthread_mutex_unlock(&map->mutex);
+    size_t off = map->arena_len;
+    memcpy(map->arena + off, key, len);
+    map->arena[off + len] = '\0';
+    map->arena_len += len + 1;
+    return off;
+}
+
+/**
+ * Прибавление value к сумме ключа с уже посчитанным хешем. Ключ может
+ * указывать прямо в строку лога: в арену он копируется только при первой
+ * вставке
+ * @param map
+ * @param h
+ * @param key
+ * @param len
+ * @param value
+ */
+static void count_map_add_hashed(CountMap *map, uint64_t h, const char *key,
+    size_t len, size_t value) {
+    size_t i = h & map->mask;
+    while (map->slots[i].hash != 0) {
+        CountSlot *s = &map->slots[i];
+        if (s->hash == h && s->key_len == len &&
+            memcmp(map->arena + s->key_off, key, len) == 0) {
+            s->value += value;
             return;
         }
-        e = e->next;
-    }
-    RefEntry *new_e = malloc(sizeof(RefEntry));
-    if (!new_e) {
-        perror("ref_map_inc: malloc RefEntry");
-        pthread_mutex_unlock(&map->mutex);
-        exit(EXIT_FAILURE);
-    }
-    new_e->key = malloc(strlen(key) + 1);
-    if (!new_e->key) {
-        perror("ref_map_inc: malloc key");
-        free(new_e);
-        pthread_mutex_unlock(&map->mutex);
-        exit(EXIT_FAILURE);
-    }
-    strcpy(new_e->key, key);
-    new_e->count = 1;
-    new_e->next = map->buckets[h];
-    map->buckets[h] = new_e;
-    pthread_mutex_unlock(&map->mutex);
-}
-
-static void url_map_free(UrlMap *map) {
-    for (size_t i = 0; i < map->size; i++) {
-        UrlEntry *e = map->buckets[i];
-        while (e) {
-            UrlEntry *next = e->next;
-            free(e->key);
-            free(e);
-            e = next;
-        }
+        i = (i + 1) & map->mask;
     }
-    free(map->buckets);
-    pthread_mutex_destroy(&map->mutex);
+    CountSlot *s = &map->slots[i];
+    s->hash = h;
+    s->key_off = arena_store(map, key, len);
+    s->key_len = len;
+    s->value = value;
+    map->count++;
+    if (map->count * 4 > (map->mask + 1) * 3)
+        count_map_grow(map);
 }
 
-static void ref_map_free(RefMap *map) {
-    for (size_t i = 0; i < map->size; i++) {
-        RefEntry *e = map->buckets[i];
-        while (e) {
-            RefEntry *next = e->next;
-            free(e->key);
-            free(e);
-            e = next;
-        }
+static void count_map_add(CountMap *map, const char *key, size_t len,
+    size_t value) {
+    count_map_add_hashed(map, hash_key(key, len), key, len, value);
+}
+
+static void count_map_free(CountMap *map) {
+    free(map->slots);
+    free(map->arena);
+}
+
+/**
+ * Прибавление всех сумм src к dst
+ * @param dst
+ * @param src
+ */
+static void count_map_merge(CountMap *dst, const CountMap *src) {
+    for (size_t i = 0; i <= src->mask; i++) {
+        const CountSlot *s = &src->slots[i];
+        if (s->hash != 0)
+            count_map_add_hashed(dst, s->hash, src->arena + s->key_off,
+                s->key_len, s->value);
     }
-    free(map->buckets);
-    pthread_mutex_destroy(&map->mutex);
 }
 
 /**
@@ -184,7 +265,15 @@ static void ref_map_free(RefMap *map) {
  * @return
  */
 static bool is_log_file(const char *name) {
-    const char *logpos = strstr(name, ".log");
+    /* суффикс сжатия отбрасывается: access.log.1.gz проверяется как
+     * access.log.1 */
+    char base[256];
+    const size_t len = strlen(name) - log_compressed_suffix(name);
+    if (len >= sizeof(base)) return false;
+    memcpy(base, name, len);
+    base[len] = '\0';
+
+    const char *logpos = strstr(base, ".log");
     if (!logpos) return false;
     const char *after = logpos + 4;
     if (*after == '\0') return true;
@@ -203,99 +292,97 @@ static bool is_log_file(const char *name) {
 /**
  * Пропуск пробелов
  * @param p
+ * @param end
  * @return
  */
-static const char *skip_spaces(const char *p) {
-    while (*p == ' ') p++;
+static const char *skip_spaces(const char *p, const char *end) {
+    while (p < end && *p == ' ') p++;
     return p;
 }
 
 /**
- * Парсинг строки лога в формате Combined Log Format
+ * Поиск символа до конца строки
+ * @param p
+ * @param end
+ * @param c
+ * @return указатель на символ или NULL
+ */
+static const char *find_char(const char *p, const char *end, char c) {
+    return memchr(p, c, (size_t)(end - p));
+}
+
+/**
+ * Парсинг строки лога в формате Combined Log Format. URI и Referer
+ * возвращаются как участки самой строки, без копирования
  * @param line
+ * @param len
  * @param url
  * @param bytes
  * @param referer
  * @return
  */
-static int parse_log_line(const char *line, char **url, size_t *bytes,
-    char **referer) {
+static int parse_log_line(const char *line, size_t len, StrView *url,
+    size_t *bytes, StrView *referer) {
     const char *p = line;
+    const char *end = line + len;
 
     /* Пропуск IP */
-    p = strchr(p, ' ');
+    p = find_char(p, end, ' ');
     if (!p) return 0;
     p++;
 
     /* Пропуск идентификатора */
-    p = strchr(p, ' ');
+    p = find_char(p, end, ' ');
     if (!p) return 0;
     p++;
 
     /* Пропуск userid */
-    p = strchr(p, '[');
+    p = find_char(p, end, '[');
     if (!p) return 0;
-    p = strchr(p, '"');
+    p = find_char(p, end, '"');
     if (!p) return 0;
     p++;
 
     /* Метод */
-    const char *method_end = strchr(p, ' ');
+    const char *method_end = find_char(p, end, ' ');
     if (!method_end) return 0;
 
     /* URI */
     const char *url_start = method_end + 1;
-    const char *url_end = strchr(url_start, ' ');
+    const char *url_end = find_char(url_start, end, ' ');
     if (!url_end) return 0;
-    size_t url_len = url_end - url_start;
 
     /* Версия протокола */
-    p = strchr(url_end, '"');
+    p = find_char(url_end, end, '"');
     if (!p) return 0;
     p++;
 
     /* Код ответа */
-    p = skip_spaces(p);
-    if (!isdigit(*p)) return 0;
-    p = strchr(p, ' ');
+    p = skip_spaces(p, end);
+    if (p == end || !isdigit((unsigned char)*p)) return 0;
+    p = find_char(p, end, ' ');
     if (!p) return 0;
     p++; /* перед размером ответа */
 
-    /* Размер ответа */
-    p = skip_spaces(p);
-    if (*p == '-') {
-        *bytes = 0;
-    } else {
-        *bytes = atoll(p);
+    /* Размер ответа, '-' означает 0 */
+    p = skip_spaces(p, end);
+    *bytes = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        *bytes = *bytes * 10 + (size_t)(*p - '0');
+        p++;
     }
 
     /* Referer */
-    p = strchr(p, '"');
+    p = find_char(p, end, '"');
     if (!p) return 0;
     p++; /* внутри кавычек Referer */
-    const char *ref_start = p;
-    const char *ref_end = strchr(p, '"');
+    const char *ref_end = find_char(p, end, '"');
     if (!ref_end) return 0;
-    size_t ref_len = ref_end - ref_start;
-
-    *url = malloc(url_len + 1);
-    if (!*url) {
-        perror("parse_log_line: malloc url");
-        return 0;
-    }
-    memcpy(*url, url_start, url_len);
-    (*url)[url_len] = '\0';
-
-    *referer = malloc(ref_len + 1);
-    if (!*referer) {
-        perror("parse_log_line: malloc referer");
-        free(*url);
-        *url = NULL;
-        return 0;
-    }
-    memcpy(*referer, ref_start, ref_len);
-    (*referer)[ref_len] = '\0';
 
+    url->ptr = url_start;
+    url->len = (size_t)(url_end - url_start);
+    referer->ptr = p;
+    referer->len = (size_t)(ref_end - p);
     return 1;
 }
 
@@ -388,135 +475,401 @@ static char **list_files(const char *dir_path, int *count) {
 }
 
 /**
- * Поток воркера
+ * Отображение файла в память целиком
+ * @param path
+ * @param file
+ * @return -1 при ошибке, пустой файл не отображается
+ */
+static int map_file(const char *path, MappedFile *file) {
+    file->data = NULL;
+    file->size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+            fd, 0);
+        if (data == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        /* каждая часть читается подряд от начала до конца */
+        posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+        file->data = data;
+        file->size = (size_t)st.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Добавление части в очередь и пробуждение ждущего потока
+ * @param q
+ * @param data
+ * @param len
+ * @param buffer Буфер распаковки, в котором лежит часть, или NULL
+ */
+static void queue_push(ChunkQueue *q, const char *data, size_t len,
+    Buffer *buffer) {
+    pthread_mutex_lock(&q->mutex);
+    if (q->count == q->capacity) {
+        size_t capacity = q->capacity ? q->capacity * 2 : 64;
+        Chunk *tmp = realloc(q->chunks, capacity * sizeof(Chunk));
+        if (!tmp) {
+            perror("queue_push: realloc");
+            exit(EXIT_FAILURE);
+        }
+        q->chunks = tmp;
+        q->capacity = capacity;
+    }
+    q->chunks[q->count].data = data;
+    q->chunks[q->count].len = len;
+    q->chunks[q->count].buffer = buffer;
+    q->count++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * Деление файла на части около CHUNK_SIZE. Граница сдвигается к концу
+ * строки, поэтому строка целиком попадает в одну часть
+ * @param q
+ * @param file
+ */
+static void split_file(ChunkQueue *q, const MappedFile *file) {
+    size_t start = 0;
+    while (start < file->size) {
+        size_t end = start + CHUNK_SIZE;
+        if (end >= file->size) {
+            end = file->size;
+        } else {
+            const char *nl = memchr(file->data + end, '\n',
+                file->size - end);
+            end = nl ? (size_t)(nl - file->data) + 1 : file->size;
+        }
+        queue_push(q, file->data + start, end - start, NULL);
+        start = end;
+    }
+}
+
+/**
+ * Создание пула из count буферов по DECODE_BUFFER_SIZE байт
+ * @param pool
+ * @param count
+ */
+static void pool_init(BufferPool *pool, int count) {
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->free = NULL;
+    for (int i = 0; i < count; i++) {
+        Buffer *b = malloc(sizeof(Buffer));
+        char *data = malloc(DECODE_BUFFER_SIZE);
+        if (!b || !data) {
+            perror("pool_init: malloc");
+            exit(EXIT_FAILURE);
+        }
+        b->data = data;
+        b->next = pool->free;
+        pool->free = b;
+    }
+}
+
+/**
+ * Свободный буфер из пула, ждёт, пока его не вернёт поток разбора
+ * @param pool
+ * @return
+ */
+static Buffer *pool_acquire(BufferPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->free)
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    Buffer *b = pool->free;
+    pool->free = b->next;
+    pthread_mutex_unlock(&pool->mutex);
+    return b;
+}
+
+static void pool_release(BufferPool *pool, Buffer *b) {
+    pthread_mutex_lock(&pool->mutex);
+    b->next = pool->free;
+    pool->free = b;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void pool_destroy(BufferPool *pool) {
+    while (pool->free) {
+        Buffer *b = pool->free;
+        pool->free = b->next;
+        free(b->data);
+        free(b);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+}
+
+/**
+ * Распаковка файла в буферы пула. Заполненный буфер уходит в очередь до
+ * последнего перевода строки, неполная строка переносится в начало
+ * следующего буфера. Строка длиннее буфера делится на части
+ * @param q
+ * @param path
+ */
+static void decode_file(ChunkQueue *q, const char *path) {
+    struct decoder *d = decoder_open(path, log_format(path));
+    if (!d)
+        return;
+    Buffer *buf = pool_acquire(q->pool);
+    size_t len = 0;
+    while (1) {
+        const ssize_t n = decoder_read(d, buf->data + len,
+            DECODE_BUFFER_SIZE - len);
+        if (n <= 0)
+            break; /* при ошибке разбирается то, что успели распаковать */
+        len += (size_t)n;
+        if (len < DECODE_BUFFER_SIZE)
+            continue;
+
+        size_t cut = len;
+        while (cut > 0 && buf->data[cut - 1] != '\n')
+            cut--;
+        if (cut == 0)
+            cut = len;
+        Buffer *next = pool_acquire(q->pool);
+        memcpy(next->data, buf->data + cut, len - cut);
+        queue_push(q, buf->data, cut, buf);
+        buf = next;
+        len -= cut;
+    }
+    if (len > 0)
+        queue_push(q, buf->data, len, buf);
+    else
+        pool_release(q->pool, buf);
+    decoder_close(d);
+}
+
+/**
+ * Поток распаковки: берёт сжатые файлы по одному, пока они не кончатся.
+ * Разбор идёт параллельно в потоках воркеров
+ * @param arg
+ * @return
+ */
+static void *decode_worker(void *arg) {
+    DecodeJobs *jobs = (DecodeJobs*)arg;
+    ChunkQueue *q = jobs->queue;
+    while (1) {
+        pthread_mutex_lock(&q->mutex);
+        const int i = jobs->next < jobs->count ? jobs->next++ : -1;
+        pthread_mutex_unlock(&q->mutex);
+        if (i == -1)
+            break;
+        decode_file(q, jobs->paths[i]);
+    }
+    pthread_mutex_lock(&q->mutex);
+    q->producers--;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
+
+/**
+ * Обработка одной строки лога
+ * @param state
+ * @param line
+ * @param len
+ * @return размер ответа, 0 для строк без него и для неразобранных
+ */
+static size_t process_line(WorkerState *state, const char *line,
+    size_t len) {
+    StrView url;
+    size_t bytes = 0;
+    StrView referer;
+    if (parse_log_line(line, len, &url, &bytes, &referer)) {
+        if (bytes > 0)
+            count_map_add(&state->url_map, url.ptr, url.len, bytes);
+        count_map_add(&state->ref_map, referer.ptr, referer.len, 1);
+        return bytes;
+    }
+    return 0;
+}
+
+/**
+ * Поток воркера: берёт части из очереди, пока они не кончатся
  * @param arg
  * @return
  */
 static void *worker(void *arg) {
-    FileQueue *q = (FileQueue*)arg;
+    WorkerState *state = (WorkerState*)arg;
+    ChunkQueue *q = state->queue;
+    size_t total_bytes = 0;
     while (1) {
         pthread_mutex_lock(&q->mutex);
-        while (q->next >= q->count && !q->finished) {
+        while (q->next >= q->count && q->producers > 0)
             pthread_cond_wait(&q->cond, &q->mutex);
-        }
-        if (q->finished && q->next >= q->count) {
+        if (q->next >= q->count) {
             pthread_mutex_unlock(&q->mutex);
             break;
         }
-        int idx = q->next;
+        Chunk chunk = q->chunks[q->next];
         q->next++;
-        if (idx == q->count - 1) {
-            q->finished = 1;
-            pthread_cond_broadcast(&q->cond);
-        }
         pthread_mutex_unlock(&q->mutex);
 
-        char *filename = q->files[idx];
-        FILE *f = fopen(filename, "r");
-        if (!f) {
-            perror("worker: fopen");
-            continue;
-        }
-        char line[MAX_LINE_LEN];
-        while (fgets(line, sizeof(line), f)) {
-            char *url = NULL;
-            size_t bytes = 0;
-            char *referer = NULL;
-            if (parse_log_line(line, &url, &bytes, &referer)) {
-                if (bytes > 0) {
-                    pthread_mutex_lock(&total_bytes_mutex);
-                    total_bytes += bytes;
-                    pthread_mutex_unlock(&total_bytes_mutex);
-                    url_map_add(&url_map, url, bytes);
-                }
-                ref_map_inc(&ref_map, referer);
-                free(url);
-                free(referer);
-            }
+        const char *p = chunk.data;
+        const char *end = chunk.data + chunk.len;
+        while (p < end) {
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            const char *line_end = nl ? nl : end;
+            total_bytes += process_line(state, p, (size_t)(line_end - p));
+            p = line_end + 1;
         }
-        fclose(f);
+        if (chunk.buffer)
+            pool_release(q->pool, chunk.buffer);
     }
+    state->total_bytes = total_bytes;
     return NULL;
 }
 
 /**
- * Сортировка вывода для топ url
- * @param a
- * @param b
+ * Поток слияния: вливает таблицы и счётчик src в dst, таблицы src
+ * освобождаются
+ * @param arg
  * @return
  */
-static int cmp_url(const void *a, const void *b) {
-    const UrlEntry *ea = *(const UrlEntry**)a;
-    const UrlEntry *eb = *(const UrlEntry**)b;
-    if (eb->bytes > ea->bytes) return 1;
-    if (eb->bytes < ea->bytes) return -1;
-    return 0;
+static void *merge_worker(void *arg) {
+    MergeJob *job = (MergeJob*)arg;
+    job->dst->total_bytes += job->src->total_bytes;
+    count_map_merge(&job->dst->url_map, &job->src->url_map);
+    count_map_merge(&job->dst->ref_map, &job->src->ref_map);
+    count_map_free(&job->src->url_map);
+    count_map_free(&job->src->ref_map);
+    return NULL;
 }
 
-static int cmp_ref(const void *a, const void *b) {
-    const RefEntry *ea = *(const RefEntry**)a;
-    const RefEntry *eb = *(const RefEntry**)b;
-    return eb->count - ea->count;
+/**
+ * Слияние таблиц потоков деревом: в раунде r поток i вливает в себя
+ * состояние i + 2^r, раунды разделены pthread_join. За log2(count)
+ * раундов итог собирается в states[0]
+ * @param states
+ * @param count
+ */
+static void merge_states(WorkerState *states, int count) {
+    const size_t max_pairs = (size_t)(count / 2 > 0 ? count / 2 : 1);
+    pthread_t *threads = malloc(max_pairs * sizeof(pthread_t));
+    MergeJob *jobs = malloc(max_pairs * sizeof(MergeJob));
+    if (!threads || !jobs) {
+        perror("merge_states: malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int step = 1; step < count; step *= 2) {
+        int pairs = 0;
+        for (int i = 0; i + step < count; i += 2 * step) {
+            jobs[pairs].dst = &states[i];
+            jobs[pairs].src = &states[i + step];
+            pthread_create(&threads[pairs], NULL, merge_worker, &jobs[pairs]);
+            pairs++;
+        }
+        for (int i = 0; i < pairs; i++)
+            pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(jobs);
 }
 
 /**
- * Сбор всех url в массив
- * @param out_count
+ * Сортировка по убыванию суммы
+ * @param a
+ * @param b
  * @return
  */
-static UrlEntry **collect_urls(int *out_count) {
-    UrlEntry **arr = NULL;
-    int cnt = 0;
-    pthread_mutex_lock(&url_map.mutex);
-    for (size_t i = 0; i < url_map.size; i++) {
-        UrlEntry *e = url_map.buckets[i];
-        while (e) {
-            UrlEntry **tmp = realloc(arr, (cnt + 1) * sizeof(UrlEntry*));
-            if (!tmp) {
-                perror("collect_urls: realloc");
-                free(arr);
-                pthread_mutex_unlock(&url_map.mutex);
-                return NULL;
-            }
-            arr = tmp;
-            arr[cnt] = e;
-            cnt++;
-            e = e->next;
+static int cmp_slot(const void *a, const void *b) {
+    const CountSlot *ea = *(const CountSlot**)a;
+    const CountSlot *eb = *(const CountSlot**)b;
+    if (eb->value > ea->value) return 1;
+    if (eb->value < ea->value) return -1;
+    return 0;
+}
+
+/* Ограниченная min-куча из K слотов с наибольшими суммами: в корне
+ * наименьший из отобранных, новый слот вытесняет его, только если больше */
+typedef struct {
+    const CountSlot **items;
+    size_t count;
+    size_t capacity;
+} TopK;
+
+static void topk_sift_down(TopK *top, size_t i) {
+    while (1) {
+        size_t min = i;
+        const size_t l = 2 * i + 1;
+        const size_t r = l + 1;
+        if (l < top->count && top->items[l]->value < top->items[min]->value)
+            min = l;
+        if (r < top->count && top->items[r]->value < top->items[min]->value)
+            min = r;
+        if (min == i)
+            return;
+        const CountSlot *tmp = top->items[i];
+        top->items[i] = top->items[min];
+        top->items[min] = tmp;
+        i = min;
+    }
+}
+
+static void topk_push(TopK *top, const CountSlot *slot) {
+    if (top->count < top->capacity) {
+        size_t i = top->count++;
+        top->items[i] = slot;
+        while (i > 0) {
+            const size_t parent = (i - 1) / 2;
+            if (top->items[parent]->value <= top->items[i]->value)
+                break;
+            const CountSlot *tmp = top->items[i];
+            top->items[i] = top->items[parent];
+            top->items[parent] = tmp;
+            i = parent;
         }
+    } else if (slot->value > top->items[0]->value) {
+        top->items[0] = slot;
+        topk_sift_down(top, 0);
     }
-    pthread_mutex_unlock(&url_map.mutex);
-    *out_count = cnt;
-    return arr;
 }
 
 /**
- * Сбор всех рефералов в массив
+ * Выбор k слотов с наибольшими суммами за один проход по таблице.
+ * Сортируются только отобранные
+ * @param map
+ * @param k Не больше числа ключей попадает в результат
  * @param out_count
- * @return
+ * @return слоты по убыванию суммы, NULL для пустой таблицы
  */
-static RefEntry **collect_refs(int *out_count) {
-    RefEntry **arr = NULL;
-    int cnt = 0;
-    pthread_mutex_lock(&ref_map.mutex);
-    for (size_t i = 0; i < ref_map.size; i++) {
-        RefEntry *e = ref_map.buckets[i];
-        while (e) {
-            RefEntry **tmp = realloc(arr, (cnt + 1) * sizeof(RefEntry*));
-            if (!tmp) {
-                perror("collect_refs: realloc");
-                free(arr);
-                pthread_mutex_unlock(&ref_map.mutex);
-                return NULL;
-            }
-            arr = tmp;
-            arr[cnt] = e;
-            cnt++;
-            e = e->next;
-        }
+static const CountSlot **top_slots(const CountMap *map, size_t k,
+    size_t *out_count) {
+    *out_count = 0;
+    if (k > map->count)
+        k = map->count;
+    if (k == 0)
+        return NULL;
+    TopK top = { malloc(k * sizeof(CountSlot*)), 0, k };
+    if (!top.items) {
+        perror("top_slots: malloc");
+        exit(EXIT_FAILURE);
     }
-    pthread_mutex_unlock(&ref_map.mutex);
-    *out_count = cnt;
-    return arr;
+    for (size_t i = 0; i <= map->mask; i++) {
+        if (map->slots[i].hash != 0)
+            topk_push(&top, &map->slots[i]);
+    }
+    qsort(top.items, top.count, sizeof(CountSlot*), cmp_slot);
+    *out_count = top.count;
+    return top.items;
 }
 
 int main(int argc, char *argv[]) {
@@ -527,9 +880,10 @@ int main(int argc, char *argv[]) {
 
     const char *dir_path = NULL;
     long num_threads_l = 1;
+    size_t top_n = TOP_N;
     int opt;
 
-    while ((opt = getopt(argc, argv, "d:t:")) != -1) {
+    while ((opt = getopt(argc, argv, "d:t:n:")) != -1) {
         switch (opt) {
         case 'd':
             dir_path = optarg;
@@ -546,9 +900,22 @@ int main(int argc, char *argv[]) {
             num_threads_l = val;
             break;
         }
+        case 'n': {
+            char *endptr;
+            errno = 0;
+            long val = strtol(optarg, &endptr, 10);
+            if (errno != 0 || *endptr != '\0' || val <= 0 ||
+                val > MAX_TOP_N) {
+                fprintf(stderr, "Ошибка: размер топа '%s' не от 1 до %d\n",
+                    optarg, MAX_TOP_N);
+                exit(EXIT_FAILURE);
+            }
+            top_n = (size_t)val;
+            break;
+        }
         default:
             fprintf(stderr, "Использование: %s -d <директория логов>"
-                            " -t <число тредов>\n",
+                            " -t <число тредов> [-n <размер топа>]\n",
                 argv[0]);
             exit(EXIT_FAILURE);
         }
@@ -557,7 +924,7 @@ int main(int argc, char *argv[]) {
     if (!dir_path) {
         fprintf(stderr, "Ошибка: не указана директория\n");
         fprintf(stderr, "Использование: %s -d <директория логов>"
-                        " -t <число тредов>\n",
+                        " -t <число тредов> [-n <размер топа>]\n",
             argv[0]);
         exit(EXIT_FAILURE);
     }
@@ -572,78 +939,128 @@ int main(int argc, char *argv[]) {
         file_count = 0;
     }
 
-
-    url_map_init(&url_map, HASH_SIZE);
-    ref_map_init(&ref_map, HASH_SIZE);
-
-    FileQueue queue = {
-        .files = files,
-        .count = file_count,
-        .next = 0,
-        .finished = 0
-    };
+    MappedFile *mapped = calloc(file_count ? file_count : 1,
+        sizeof(MappedFile));
+    if (!mapped) {
+        perror("main: calloc mapped");
+        return 1;
+    }
+    DecodeJobs jobs = {0};
+    jobs.paths = malloc((file_count ? file_count : 1) * sizeof(char*));
+    if (!jobs.paths) {
+        perror("main: malloc jobs");
+        return 1;
+    }
+    ChunkQueue queue = {0};
     pthread_mutex_init(&queue.mutex, NULL);
     pthread_cond_init(&queue.cond, NULL);
+    jobs.queue = &queue;
+    for (int i = 0; i < file_count; i++) {
+        const enum log_format format = log_format(files[i]);
+        if (format != LOG_PLAIN) {
+            if (decoder_supported(format))
+                jobs.paths[jobs.count++] = files[i];
+            else
+                fprintf(stderr, "%s: пропущен, сборка без поддержки"
+                    " этого сжатия\n", files[i]);
+        } else if (map_file(files[i], &mapped[i]) == 0) {
+            split_file(&queue, &mapped[i]);
+        }
+    }
+
+    /* потоков распаковки столько же, сколько потоков разбора, но не
+     * больше числа сжатых файлов. Каждому нужно до двух буферов сразу,
+     * ещё по одному на поток разбора */
+    const int num_decoders = jobs.count < num_threads ? jobs.count
+        : num_threads;
+    BufferPool pool;
+    pool_init(&pool, num_decoders > 0 ? 2 * num_decoders + num_threads : 0);
+    queue.pool = &pool;
+    queue.producers = num_decoders;
+    pthread_t *decoders = malloc((size_t)(num_decoders > 0 ? num_decoders
+        : 1) * sizeof(pthread_t));
+    if (!decoders) {
+        perror("main: malloc decoders");
+        return 1;
+    }
+    for (int i = 0; i < num_decoders; i++)
+        pthread_create(&decoders[i], NULL, decode_worker, &jobs);
 
     pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
-    if (!threads) {
+    /* sizeof кратен CACHE_LINE, как того требует aligned_alloc */
+    WorkerState *states = aligned_alloc(CACHE_LINE,
+        num_threads * sizeof(WorkerState));
+    if (!threads || !states) {
         perror("main: malloc threads");
         return 1;
     }
-    for (int i = 0; i < num_threads; i++)
-        pthread_create(&threads[i], NULL, worker, &queue);
-
-    if (file_count == 0) {
-        pthread_mutex_lock(&queue.mutex);
-        queue.finished = 1;
-        pthread_cond_broadcast(&queue.cond);
-        pthread_mutex_unlock(&queue.mutex);
+    memset(states, 0, num_threads * sizeof(WorkerState));
+    for (int i = 0; i < num_threads; i++) {
+        states[i].queue = &queue;
+        count_map_init(&states[i].url_map, HASH_SIZE);
+        count_map_init(&states[i].ref_map, HASH_SIZE);
+        pthread_create(&threads[i], NULL, worker, &states[i]);
     }
 
     for (int i = 0; i < num_threads; i++)
         pthread_join(threads[i], NULL);
     free(threads);
+    for (int i = 0; i < num_decoders; i++)
+        pthread_join(decoders[i], NULL);
+    free(decoders);
 
-    printf("Всего байт: %lu\n", total_bytes);
-
-    int url_cnt = 0;
-    UrlEntry **urls = collect_urls(&url_cnt);
-    if (urls) {
-        qsort(urls, url_cnt, sizeof(UrlEntry*), cmp_url);
-        printf("\nТоп %d URI по трафику:\n", TOP_N);
-        for (int i = 0; i < TOP_N && i < url_cnt; i++) {
-            char *decoded = url_decode(urls[i]->key);
-            printf("%lu %s\n", urls[i]->bytes,
-                decoded ? decoded : urls[i]->key);
+    /* итог собирается в таблицах первого потока */
+    merge_states(states, num_threads);
+    WorkerState *total = &states[0];
+
+    printf("Всего байт: %zu\n", total->total_bytes);
+
+    size_t url_cnt = 0;
+    const CountSlot **urls = top_slots(&total->url_map, top_n, &url_cnt);
+    if (url_cnt > 0) {
+        printf("\nТоп %zu URI по трафику:\n", url_cnt);
+        for (size_t i = 0; i < url_cnt; i++) {
+            const char *key = total->url_map.arena + urls[i]->key_off;
+            char *decoded = url_decode(key);
+            printf("%zu %s\n", urls[i]->value, decoded ? decoded : key);
             if (decoded)
                 free(decoded);
         }
-        free(urls);
     } else {
         printf("\nТоп URI: нет\n");
     }
+    free(urls);
 
-    int ref_cnt = 0;
-    RefEntry **refs = collect_refs(&ref_cnt);
-    if (refs) {
-        qsort(refs, ref_cnt, sizeof(RefEntry*), cmp_ref);
-        printf("\nТоп %d рефералов:\n", TOP_N);
-        for (int i = 0; i < TOP_N && i < ref_cnt; i++) {
-            printf("%d %s\n", refs[i]->count, refs[i]->key);
+    size_t ref_cnt = 0;
+    const CountSlot **refs = top_slots(&total->ref_map, top_n, &ref_cnt);
+    if (ref_cnt > 0) {
+        printf("\nТоп %zu рефералов:\n", ref_cnt);
+        for (size_t i = 0; i < ref_cnt; i++) {
+            printf("%zu %s\n", refs[i]->value,
+                total->ref_map.arena + refs[i]->key_off);
         }
-        free(refs);
     } else {
         printf("\nТоп рефералов: нет\n");
     }
+    free(refs);
 
+    for (int i = 0; i < file_count; i++) {
+        if (mapped[i].data)
+            munmap(mapped[i].data, mapped[i].size);
+    }
+    free(mapped);
     if (files) {
         for (int i = 0; i < file_count; i++) free(files[i]);
         free(files);
     }
+    free(jobs.paths);
+    free(queue.chunks);
     pthread_mutex_destroy(&queue.mutex);
     pthread_cond_destroy(&queue.cond);
-    url_map_free(&url_map);
-    ref_map_free(&ref_map);
+    pool_destroy(&pool);
+    count_map_free(&total->url_map);
+    count_map_free(&total->ref_map);
+    free(states);
 
     exit(EXIT_SUCCESS);
 }
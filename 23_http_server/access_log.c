@@ -0,0 +1,228 @@
+#include "access_log.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RING_MASK (ACCESS_LOG_RING_SIZE - 1)
+/* строка лога не длиннее: каждый байт полей может стать \xHH */
+#define LINE_MAX_LEN (128 + 4 * (ACCESS_LOG_REQUEST_SIZE + \
+    2 * ACCESS_LOG_FIELD_SIZE))
+
+int access_log_open(struct access_log *log, const char *path, int nrings) {
+    memset(log, 0, sizeof(*log));
+    atomic_init(&log->stop, false);
+    log->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log->fd == -1) {
+        perror(path);
+        return -1;
+    }
+    log->buf = malloc(ACCESS_LOG_BATCH);
+    log->rings = calloc((size_t)nrings, sizeof(*log->rings));
+    if (!log->buf || !log->rings) {
+        perror("access_log_open");
+        access_log_close(log);
+        return -1;
+    }
+    log->nrings = nrings;
+    for (int i = 0; i < nrings; i++) {
+        log->rings[i].records = malloc(ACCESS_LOG_RING_SIZE *
+            sizeof(struct access_record));
+        if (!log->rings[i].records) {
+            perror("access_log_open");
+            access_log_close(log);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static uint16_t copy_field(char *dst, size_t cap, const char *src,
+    size_t len) {
+    if (len > cap)
+        len = cap;
+    memcpy(dst, src, len);
+    return (uint16_t)len;
+}
+
+bool access_log_push(struct access_ring *ring, uint32_t addr, int status,
+    uint64_t bytes, const char *request, size_t request_len,
+    const char *referer, size_t referer_len, const char *agent,
+    size_t agent_len) {
+    const size_t head = atomic_load_explicit(&ring->head,
+        memory_order_relaxed);
+    const size_t tail = atomic_load_explicit(&ring->tail,
+        memory_order_acquire);
+    if (head - tail == ACCESS_LOG_RING_SIZE)
+        return false;
+
+    struct access_record *rec = &ring->records[head & RING_MASK];
+    rec->time = time(NULL);
+    rec->addr = addr;
+    rec->status = status;
+    rec->bytes = bytes;
+    rec->request_len = copy_field(rec->request, sizeof(rec->request),
+        request, request_len);
+    rec->referer_len = copy_field(rec->referer, sizeof(rec->referer),
+        referer, referer_len);
+    rec->agent_len = copy_field(rec->agent, sizeof(rec->agent), agent,
+        agent_len);
+
+    /* запись видна потоку записи только после заполнения */
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+static void flush(struct access_log *log) {
+    const char *p = log->buf;
+    size_t left = log->buf_len;
+    while (left > 0) {
+        ssize_t n = write(log->fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("access log write");
+            break;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    log->buf_len = 0;
+}
+
+/**
+ * Копирование поля в кавычках с экранированием кавычек, обратной косой
+ * черты и управляющих символов как \xHH. Пустое поле выводится как -
+ * @param out
+ * @param src
+ * @param len
+ * @return
+ */
+static char *append_quoted(char *out, const char *src, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    *out++ = '"';
+    if (len == 0)
+        *out++ = '-';
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = (unsigned char)src[i];
+        if (c < 0x20 || c == 0x7f || c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = 'x';
+            *out++ = hex[c >> 4];
+            *out++ = hex[c & 0xf];
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    *out++ = '"';
+    return out;
+}
+
+static void format_record(struct access_log *log,
+    const struct access_record *rec) {
+    if (ACCESS_LOG_BATCH - log->buf_len < LINE_MAX_LEN)
+        flush(log);
+
+    /* время меняется раз в секунду, строка формируется заново только
+     * при смене секунды */
+    if (rec->time != log->last_time) {
+        struct tm tm;
+        localtime_r(&rec->time, &tm);
+        strftime(log->time_str, sizeof(log->time_str),
+            "%d/%b/%Y:%H:%M:%S %z", &tm);
+        log->last_time = rec->time;
+    }
+
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in = { .s_addr = rec->addr };
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+
+    char *out = log->buf + log->buf_len;
+    out += sprintf(out, "%s - - [%s] ", addr, log->time_str);
+    out = append_quoted(out, rec->request, rec->request_len);
+    if (rec->bytes > 0)
+        out += sprintf(out, " %d %llu ", rec->status,
+            (unsigned long long)rec->bytes);
+    else
+        out += sprintf(out, " %d - ", rec->status);
+    out = append_quoted(out, rec->referer, rec->referer_len);
+    *out++ = ' ';
+    out = append_quoted(out, rec->agent, rec->agent_len);
+    *out++ = '\n';
+    log->buf_len = (size_t)(out - log->buf);
+}
+
+/**
+ * Разбор всех накопившихся записей кольца
+ * @param log
+ * @param ring
+ * @return число записей
+ */
+static size_t drain(struct access_log *log, struct access_ring *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    const size_t head = atomic_load_explicit(&ring->head,
+        memory_order_acquire);
+    const size_t count = head - tail;
+    for (; tail != head; tail++)
+        format_record(log, &ring->records[tail & RING_MASK]);
+    /* место освобождается для воркера после разбора */
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    return count;
+}
+
+static void *writer_loop(void *arg) {
+    struct access_log *log = arg;
+    const struct timespec idle = {
+        .tv_sec = 0,
+        .tv_nsec = ACCESS_LOG_IDLE_MS * 1000000L
+    };
+    while (!atomic_load_explicit(&log->stop, memory_order_acquire)) {
+        size_t count = 0;
+        for (int i = 0; i < log->nrings; i++)
+            count += drain(log, &log->rings[i]);
+        if (log->buf_len > 0)
+            flush(log);
+        /* воркеры не будят поток записи, чтобы не делать системных
+         * вызовов на пути запроса, поэтому при простое он спит */
+        if (count == 0)
+            nanosleep(&idle, NULL);
+    }
+    for (int i = 0; i < log->nrings; i++)
+        drain(log, &log->rings[i]);
+    if (log->buf_len > 0)
+        flush(log);
+    return NULL;
+}
+
+int access_log_start(struct access_log *log) {
+    errno = pthread_create(&log->thread, NULL, writer_loop, log);
+    if (errno != 0) {
+        perror("pthread_create access log");
+        return -1;
+    }
+    log->started = true;
+    return 0;
+}
+
+void access_log_close(struct access_log *log) {
+    if (log->started) {
+        atomic_store_explicit(&log->stop, true, memory_order_release);
+        pthread_join(log->thread, NULL);
+        log->started = false;
+    }
+    if (log->rings) {
+        for (int i = 0; i < log->nrings; i++)
+            free(log->rings[i].records);
+        free(log->rings);
+        log->rings = NULL;
+    }
+    free(log->buf);
+    log->buf = NULL;
+    if (log->fd != -1)
+        close(log->fd);
+    log->fd = -1;
+}
@@ -0,0 +1,97 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define ACCESS_LOG_RING_SIZE 4096 /* записей на воркер, степень двойки */
+#define ACCESS_LOG_REQUEST_SIZE 256
+#define ACCESS_LOG_FIELD_SIZE 192
+#define ACCESS_LOG_BATCH (256 * 1024)
+#define ACCESS_LOG_IDLE_MS 10
+
+/* Запись о запросе фиксированного размера. Строки обрезаются и
+ * экранируются уже потоком записи */
+struct access_record {
+    time_t time;
+    uint32_t addr; /* IPv4 в сетевом порядке байт */
+    int status;
+    uint64_t bytes;
+    uint16_t request_len;
+    uint16_t referer_len;
+    uint16_t agent_len;
+    char request[ACCESS_LOG_REQUEST_SIZE];
+    char referer[ACCESS_LOG_FIELD_SIZE];
+    char agent[ACCESS_LOG_FIELD_SIZE];
+};
+
+/* Кольцо одного воркера: head пишет только воркер, tail — только поток
+ * записи. Счётчики разнесены по разным строкам кэша */
+struct access_ring {
+    _Atomic size_t head;
+    char pad1[64 - sizeof(size_t)];
+    _Atomic size_t tail;
+    char pad2[64 - sizeof(size_t)];
+    struct access_record *records;
+};
+
+struct access_log {
+    int fd;
+    int nrings;
+    struct access_ring *rings;
+    char *buf;
+    size_t buf_len;
+    pthread_t thread;
+    bool started;
+    atomic_bool stop;
+    time_t last_time;
+    char time_str[32];
+};
+
+/**
+ * Открытие лога и создание колец для воркеров
+ * @param log
+ * @param path
+ * @param nrings
+ * @return
+ */
+int access_log_open(struct access_log *log, const char *path, int nrings);
+
+/**
+ * Запуск фонового потока записи
+ * @param log
+ * @return
+ */
+int access_log_start(struct access_log *log);
+
+/**
+ * Запись о завершённом запросе в кольцо воркера. Не блокирует и не
+ * выделяет память
+ * @param ring
+ * @param addr
+ * @param status
+ * @param bytes размер тела ответа
+ * @param request строка запроса
+ * @param request_len
+ * @param referer
+ * @param referer_len
+ * @param agent
+ * @param agent_len
+ * @return false, если кольцо заполнено и запись потеряна
+ */
+bool access_log_push(struct access_ring *ring, uint32_t addr, int status,
+    uint64_t bytes, const char *request, size_t request_len,
+    const char *referer, size_t referer_len, const char *agent,
+    size_t agent_len);
+
+/**
+ * Остановка потока записи, дозапись колец и закрытие лога
+ * @param log
+ */
+void access_log_close(struct access_log *log);
+
+#endif /* ACCESS_LOG_H */
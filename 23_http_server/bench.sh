@@ -0,0 +1,46 @@
+#!/bin/bash
+# Нагрузочный прогон: сервер на временном каталоге с синтетическими
+# файлами и стандартный набор сценариев http_bench.
+# Использование: bench.sh <23_http_server> <http_bench>
+# Переменные: BENCH_PORT, BENCH_WORKERS, BENCH_DURATION
+
+SERVER=${1:-./23_http_server}
+BENCH=${2:-./http_bench}
+PORT=${BENCH_PORT:-18080}
+WORKERS=${BENCH_WORKERS:-2}
+DURATION=${BENCH_DURATION:-5}
+ADDR=127.0.0.1:$PORT
+
+ROOT=$(mktemp -d) || exit 1
+PID=
+cleanup() {
+	[ -n "$PID" ] && kill "$PID" 2>/dev/null
+	rm -rf "$ROOT"
+}
+trap cleanup EXIT
+
+head -c 1024 /dev/urandom > "$ROOT/small.bin"
+head -c 65536 /dev/urandom > "$ROOT/medium.bin"
+head -c 8388608 /dev/urandom > "$ROOT/large.bin"
+
+"$SERVER" -d "$ROOT" -l "$ADDR" -w "$WORKERS" &
+PID=$!
+sleep 1
+if ! kill -0 "$PID" 2>/dev/null; then
+	echo "Сервер не запустился" >&2
+	PID=
+	exit 1
+fi
+
+run() {
+	echo "== $*"
+	"$BENCH" -a "$ADDR" -d "$DURATION" "$@"
+	echo
+}
+
+for file in small.bin medium.bin large.bin; do
+	run -u "/$file" -c 64
+	run -u "/$file" -c 64 -C
+done
+run -u /small.bin -c 64 -r 20000
+run -u /medium.bin -c 64 -r 5000
@@ -0,0 +1,38 @@
+#include "buf_pool.h"
+#include <stdlib.h>
+
+void buf_pool_init(struct buf_pool *pool, size_t size, size_t max_free) {
+    pool->free = NULL;
+    pool->size = size;
+    pool->nfree = 0;
+    pool->max_free = max_free;
+}
+
+void *buf_pool_get(struct buf_pool *pool) {
+    if (pool->free) {
+        void *buf = pool->free;
+        pool->free = *(void **)buf;
+        pool->nfree--;
+        return buf;
+    }
+    return malloc(pool->size);
+}
+
+void buf_pool_put(struct buf_pool *pool, void *buf) {
+    if (pool->nfree >= pool->max_free) {
+        free(buf);
+        return;
+    }
+    *(void **)buf = pool->free;
+    pool->free = buf;
+    pool->nfree++;
+}
+
+void buf_pool_destroy(struct buf_pool *pool) {
+    while (pool->free) {
+        void *buf = pool->free;
+        pool->free = *(void **)buf;
+        free(buf);
+    }
+    pool->nfree = 0;
+}
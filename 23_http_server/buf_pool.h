@@ -0,0 +1,44 @@
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+
+/* Пул буферов одного размера. Свободные буферы связаны в список через
+ * свои первые байты, часть из них удерживается для повторного
+ * использования, остальные возвращаются в malloc */
+struct buf_pool {
+    void *free;
+    size_t size;
+    size_t nfree;
+    size_t max_free;
+};
+
+/**
+ * Инициализация пула
+ * @param pool
+ * @param size Размер буфера, не меньше sizeof(void *)
+ * @param max_free Сколько свободных буферов удерживать
+ */
+void buf_pool_init(struct buf_pool *pool, size_t size, size_t max_free);
+
+/**
+ * Получение буфера
+ * @param pool
+ * @return буфер или NULL при нехватке памяти
+ */
+void *buf_pool_get(struct buf_pool *pool);
+
+/**
+ * Возврат буфера в пул
+ * @param pool
+ * @param buf
+ */
+void buf_pool_put(struct buf_pool *pool, void *buf);
+
+/**
+ * Освобождение удерживаемых буферов
+ * @param pool
+ */
+void buf_pool_destroy(struct buf_pool *pool);
+
+#endif /* BUF_POOL_H */
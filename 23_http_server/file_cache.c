@@ -0,0 +1,305 @@
+#include "file_cache.h"
+#include <sys/event.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t hash_path(const char *path, enum file_encoding encoding) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 1099511628211ULL;
+    }
+    h ^= (uint64_t)encoding;
+    h *= 1099511628211ULL;
+    return h;
+}
+
+static const char *encoding_name(enum file_encoding encoding) {
+    switch (encoding) {
+        case FILE_ENC_GZIP:
+            return "gzip";
+        case FILE_ENC_BR:
+            return "br";
+        case FILE_ENC_DEFLATE:
+            return "deflate";
+        default:
+            return NULL;
+    }
+}
+
+static void lru_unlink(struct file_cache *cache, struct file_entry *e) {
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache->lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void lru_push_front(struct file_cache *cache, struct file_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->lru_prev = e;
+    cache->lru_head = e;
+    if (!cache->lru_tail)
+        cache->lru_tail = e;
+}
+
+/**
+ * Перенос записи без ссылок в список на освобождение
+ * @param cache
+ * @param e
+ */
+static void bury(struct file_cache *cache, struct file_entry *e) {
+    if (e->fd != -1)
+        close(e->fd);
+    e->fd = -1;
+    e->dead_next = cache->dead;
+    cache->dead = e;
+}
+
+/**
+ * Исключение записи из индекса и LRU. Новые запросы её больше не
+ * найдут, а текущие отправки дорабатывают со своими ссылками
+ * @param cache
+ * @param e
+ */
+static void detach(struct file_cache *cache, struct file_entry *e) {
+    if (e->detached)
+        return;
+    struct file_entry **pp = &cache->buckets[e->hash % FILE_CACHE_BUCKETS];
+    while (*pp && *pp != e)
+        pp = &(*pp)->hash_next;
+    if (*pp)
+        *pp = e->hash_next;
+    lru_unlink(cache, e);
+    cache->count--;
+    if (e->in_memory)
+        cache->mem_used -= e->size;
+    e->detached = true;
+    if (e->refs == 0)
+        bury(cache, e);
+}
+
+void file_cache_init(struct file_cache *cache, int kq, size_t max_files,
+    size_t small_file, size_t max_mem) {
+    memset(cache, 0, sizeof(*cache));
+    cache->kq = kq;
+    cache->max_files = max_files;
+    cache->small_file = small_file;
+    cache->max_mem = max_mem;
+}
+
+/**
+ * Чтение небольшого файла целиком в память
+ * @param cache
+ * @param e
+ */
+static void load_data(struct file_cache *cache, struct file_entry *e) {
+    if (e->size > cache->small_file || e->size > cache->max_mem)
+        return;
+    if (e->size > 0) {
+        e->data = malloc(e->size);
+        if (!e->data)
+            return;
+        size_t done = 0;
+        while (done < e->size) {
+            ssize_t nr = pread(e->fd, e->data + done, e->size - done,
+                (off_t)done);
+            if (nr <= 0) {
+                /* файл меняется прямо сейчас, отдаём его с диска */
+                free(e->data);
+                e->data = NULL;
+                return;
+            }
+            done += (size_t)nr;
+        }
+    }
+    e->in_memory = true;
+}
+
+struct file_entry *file_cache_lookup(struct file_cache *cache,
+    const char *path, enum file_encoding encoding) {
+    const uint64_t h = hash_path(path, encoding);
+    struct file_entry *e = cache->buckets[h % FILE_CACHE_BUCKETS];
+    while (e) {
+        if (e->hash == h && e->encoding == encoding &&
+            strcmp(e->path, path) == 0)
+            break;
+        e = e->hash_next;
+    }
+    if (!e) {
+        stats_add(&cache->stats.misses, 1);
+        return NULL;
+    }
+
+    /* без наблюдения через kqueue запись живёт FILE_CACHE_TTL секунд */
+    if (!e->watched && time(NULL) >= e->expires) {
+        detach(cache, e);
+        stats_add(&cache->stats.misses, 1);
+        return NULL;
+    }
+
+    if (e->fd == -1) {
+        e->refs++;
+        return e;
+    }
+
+    stats_add(&cache->stats.hits, 1);
+    if (e->in_memory)
+        stats_add(&cache->stats.mem_hits, 1);
+
+    lru_unlink(cache, e);
+    lru_push_front(cache, e);
+    e->refs++;
+    return e;
+}
+
+/**
+ * Создание захваченной записи
+ * @param path
+ * @param encoding
+ * @param fd
+ * @return
+ */
+static struct file_entry *new_entry(const char *path,
+    enum file_encoding encoding, int fd) {
+    struct file_entry *e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->path = strdup(path);
+    if (!e->path) {
+        free(e);
+        return NULL;
+    }
+    e->encoding = encoding;
+    e->hash = hash_path(path, encoding);
+    e->fd = fd;
+    e->refs = 1;
+    return e;
+}
+
+/**
+ * Добавление записи в индекс с вытеснением по LRU
+ * @param cache
+ * @param e
+ */
+static void index_entry(struct file_cache *cache, struct file_entry *e) {
+    while (cache->lru_tail && (cache->count >= cache->max_files ||
+        (e->in_memory && cache->mem_used + e->size > cache->max_mem)))
+        detach(cache, cache->lru_tail);
+    if (e->in_memory)
+        cache->mem_used += e->size;
+
+    const size_t b = e->hash % FILE_CACHE_BUCKETS;
+    e->hash_next = cache->buckets[b];
+    cache->buckets[b] = e;
+    lru_push_front(cache, e);
+    cache->count++;
+}
+
+struct file_entry *file_cache_insert(struct file_cache *cache,
+    const char *path, enum file_encoding encoding, int fd,
+    const struct stat *st, const char *mime, bool vary) {
+    struct file_entry *e = new_entry(path, encoding, fd);
+    if (!e)
+        return NULL;
+    e->size = (size_t)st->st_size;
+    e->mtime = st->st_mtime;
+
+    /* сильный ETag меняется вместе с inode, размером или mtime */
+    snprintf(e->etag, sizeof(e->etag), "\"%llx-%llx-%llx\"",
+        (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+        (unsigned long long)st->st_mtime);
+    if (!file_entry_set_header(e, mime, vary)) {
+        free(e->path);
+        free(e);
+        return NULL;
+    }
+
+    /* изменение, удаление или переименование файла исключает запись */
+    struct kevent ev = {0};
+    EV_SET(&ev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+        NOTE_DELETE | NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_RENAME |
+        NOTE_REVOKE, 0, e);
+    e->watched = kevent(cache->kq, &ev, 1, NULL, 0, NULL) == 0;
+    if (!e->watched)
+        e->expires = time(NULL) + FILE_CACHE_TTL;
+
+    load_data(cache, e);
+    index_entry(cache, e);
+    return e;
+}
+
+struct file_entry *file_cache_insert_missing(struct file_cache *cache,
+    const char *path, enum file_encoding encoding) {
+    struct file_entry *e = new_entry(path, encoding, -1);
+    if (!e)
+        return NULL;
+    e->expires = time(NULL) + FILE_CACHE_TTL;
+    index_entry(cache, e);
+    return e;
+}
+
+bool file_entry_set_header(struct file_entry *e, const char *mime,
+    bool vary) {
+    e->mime = mime;
+    e->vary = vary;
+    struct tm tm;
+    gmtime_r(&e->mtime, &tm);
+    strftime(e->last_modified, sizeof(e->last_modified),
+        "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    const char *enc = encoding_name(e->encoding);
+    const int written = snprintf(e->header, sizeof(e->header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "Accept-Ranges: %s\r\n"
+        "%s%s%s"
+        "%s",
+        mime, e->size, e->etag, e->last_modified,
+        /* поток zlib участника архива отдаётся только целиком */
+        e->encoding == FILE_ENC_DEFLATE ? "none" : "bytes",
+        enc ? "Content-Encoding: " : "", enc ? enc : "", enc ? "\r\n" : "",
+        vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (written < 0 || (size_t)written >= sizeof(e->header))
+        return false;
+    e->header_len = (size_t)written;
+    return true;
+}
+
+void file_cache_release(struct file_cache *cache, struct file_entry *entry) {
+    entry->refs--;
+    if (entry->refs == 0 && entry->detached)
+        bury(cache, entry);
+}
+
+void file_cache_invalidate(struct file_cache *cache, struct file_entry *entry) {
+    detach(cache, entry);
+}
+
+void file_cache_collect(struct file_cache *cache) {
+    while (cache->dead) {
+        struct file_entry *e = cache->dead;
+        cache->dead = e->dead_next;
+        free(e->data);
+        free(e->path);
+        free(e);
+    }
+}
+
+void file_cache_destroy(struct file_cache *cache) {
+    while (cache->lru_head)
+        detach(cache, cache->lru_head);
+    file_cache_collect(cache);
+}
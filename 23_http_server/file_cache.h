@@ -0,0 +1,166 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define FILE_CACHE_BUCKETS 1024
+#define FILE_CACHE_MAX_FILES 128
+#define FILE_CACHE_TTL 2
+#define FILE_HEADER_SIZE 512 /* с запасом для типа длиной MIME_MAX_TYPE */
+#define FILE_ETAG_SIZE 64
+#define FILE_DATE_SIZE 32
+#define FILE_CACHE_SMALL_FILE 16384
+#define FILE_CACHE_MAX_MEM (16 * 1024 * 1024)
+
+/* Кодирование содержимого: сам файл, его сжатая копия рядом
+ * (file.gz, file.br) или сжатый участник архива сайта */
+enum file_encoding {
+    FILE_ENC_IDENTITY,
+    FILE_ENC_GZIP,
+    FILE_ENC_BR,
+    FILE_ENC_DEFLATE
+};
+
+/* Открытый файл с метаданными и готовым началом заголовка ответа.
+ * Содержимое небольших файлов (in_memory) хранится в data. Запись с
+ * fd == -1 запоминает, что сжатой копии нет. Участники архива сайта
+ * описываются такими же записями вне кэша, их содержимое лежит в fd
+ * архива со смещения offset */
+struct file_entry {
+    struct file_entry *hash_next;
+    struct file_entry *lru_prev;
+    struct file_entry *lru_next;
+    struct file_entry *dead_next;
+    char *path;
+    enum file_encoding encoding;
+    uint64_t hash;
+    int fd;
+    off_t offset;
+    size_t size;
+    time_t mtime;
+    char etag[FILE_ETAG_SIZE];
+    char last_modified[FILE_DATE_SIZE];
+    const char *mime;
+    char *data;
+    bool in_memory;
+    char header[FILE_HEADER_SIZE];
+    size_t header_len;
+    bool vary; /* в заголовке есть Vary: Accept-Encoding */
+    unsigned refs;
+    bool detached;
+    bool watched;
+    time_t expires;
+};
+
+/* Кэш одного воркера, блокировки не нужны */
+struct file_cache {
+    int kq;
+    struct file_entry *buckets[FILE_CACHE_BUCKETS];
+    struct file_entry *lru_head;
+    struct file_entry *lru_tail;
+    struct file_entry *dead;
+    size_t count;
+    size_t max_files;
+    size_t small_file;
+    size_t mem_used;
+    size_t max_mem;
+    struct cache_stats stats;
+};
+
+/**
+ * Инициализация кэша
+ * @param cache
+ * @param kq kqueue воркера, в нём отслеживаются изменения файлов
+ * @param max_files Максимальное число открытых файлов в кэше
+ * @param small_file Файлы не больше этого размера читаются в память
+ * @param max_mem Предел памяти под содержимое файлов
+ */
+void file_cache_init(struct file_cache *cache, int kq, size_t max_files,
+    size_t small_file, size_t max_mem);
+
+/**
+ * Поиск файла по декодированному пути запроса. Найденная запись
+ * захватывается, её нужно вернуть через file_cache_release
+ * @param cache
+ * @param path
+ * @param encoding
+ * @return запись или NULL
+ */
+struct file_entry *file_cache_lookup(struct file_cache *cache,
+    const char *path, enum file_encoding encoding);
+
+/**
+ * Добавление открытого файла в кэш. Кэш становится владельцем fd,
+ * запись возвращается захваченной. Небольшой файл сразу читается в
+ * память, дальше он отдаётся без обращений к файловой системе
+ * @param cache
+ * @param path Декодированный путь запроса
+ * @param encoding
+ * @param fd
+ * @param st Результат fstat для fd
+ * @param mime
+ * @param vary Добавлять Vary: Accept-Encoding
+ * @return запись или NULL при нехватке памяти или слишком длинном
+ * заголовке (fd не закрывается)
+ */
+struct file_entry *file_cache_insert(struct file_cache *cache,
+    const char *path, enum file_encoding encoding, int fd,
+    const struct stat *st, const char *mime, bool vary);
+
+/**
+ * Запоминание отсутствия сжатой копии на FILE_CACHE_TTL секунд, чтобы
+ * не искать её на каждом запросе
+ * @param cache
+ * @param path
+ * @param encoding
+ * @return захваченная запись с fd == -1 или NULL
+ */
+struct file_entry *file_cache_insert_missing(struct file_cache *cache,
+    const char *path, enum file_encoding encoding);
+
+/**
+ * Формирование Last-Modified и заготовки заголовка 200 по размеру, mtime,
+ * ETag и кодированию записи
+ * @param e
+ * @param mime
+ * @param vary Добавлять Vary: Accept-Encoding
+ * @return false, если заголовок не поместился в FILE_HEADER_SIZE
+ */
+bool file_entry_set_header(struct file_entry *e, const char *mime, bool vary);
+
+/**
+ * Освобождение захваченной записи
+ * @param cache
+ * @param entry
+ */
+void file_cache_release(struct file_cache *cache, struct file_entry *entry);
+
+/**
+ * Исключение записи из кэша по событию EVFILT_VNODE. Файл закрывается,
+ * когда его перестанут отправлять все соединения
+ * @param cache
+ * @param entry
+ */
+void file_cache_invalidate(struct file_cache *cache, struct file_entry *entry);
+
+/**
+ * Освобождение исключённых записей. Вызывается после обработки пачки
+ * событий, когда на записи не осталось ссылок из kevent
+ * @param cache
+ */
+void file_cache_collect(struct file_cache *cache);
+
+/**
+ * Закрытие всех файлов и освобождение памяти
+ * @param cache
+ */
+void file_cache_destroy(struct file_cache *cache);
+
+#endif /* FILE_CACHE_H */
@@ -0,0 +1,549 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <getopt.h>
+
+#define MAX_CONNS 16384
+#define HEAD_BUF_SIZE 4096
+#define BODY_BUF_SIZE 65536
+#define REQ_BUF_SIZE 2048
+#define MAX_KEVENTS 256
+#define DRAIN_TIMEOUT_US 2000000
+
+enum slot_state {
+    SLOT_IDLE,
+    SLOT_CONNECTING,
+    SLOT_WRITING,
+    SLOT_READING
+};
+
+/* Место для одного запроса в полёте. В режиме keep-alive соединение
+ * переживает запросы, в режиме close открывается на каждый запрос */
+struct slot {
+    int fd;
+    enum slot_state state;
+    bool has_request;
+    bool server_close;
+    uint64_t start_us; /* запланированное (при -r) или фактическое время */
+    size_t req_sent;
+    char head[HEAD_BUF_SIZE];
+    size_t head_len;
+    bool in_body;
+    uint64_t body_left;
+};
+
+static struct {
+    struct sockaddr_in addr;
+    const char *host;
+    const char *path;
+    int nconns;
+    double duration;
+    double rate;
+    bool close_mode;
+    char request[REQ_BUF_SIZE];
+    size_t request_len;
+} bench = { .path = "/", .nconns = 64, .duration = 10 };
+
+static struct {
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t bad_status;
+    uint64_t bytes;
+    uint64_t *samples;
+    size_t nsamples;
+    size_t capacity;
+} result;
+
+static int kq = -1;
+static struct slot *slots;
+static int *idle;
+static int nidle;
+static int inflight;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void set_event(int fd, int filter, int flags, void *udata) {
+    struct kevent ev;
+    EV_SET(&ev, fd, filter, flags, 0, 0, udata);
+    kevent(kq, &ev, 1, NULL, 0, NULL);
+}
+
+static void add_sample(uint64_t us) {
+    if (result.nsamples == result.capacity) {
+        size_t capacity = result.capacity ? result.capacity * 2 : 65536;
+        uint64_t *tmp = realloc(result.samples, capacity * sizeof(*tmp));
+        if (!tmp)
+            die("realloc");
+        result.samples = tmp;
+        result.capacity = capacity;
+    }
+    result.samples[result.nsamples++] = us;
+}
+
+static void make_idle(struct slot *s) {
+    s->state = SLOT_IDLE;
+    s->has_request = false;
+    idle[nidle++] = (int)(s - slots);
+}
+
+static void close_slot(struct slot *s) {
+    if (s->fd != -1) {
+        close(s->fd);
+        s->fd = -1;
+    }
+}
+
+/**
+ * Неблокирующее подключение слота. Событие записи сообщит о результате
+ * @param s
+ * @return
+ */
+static bool connect_slot(struct slot *s) {
+    s->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->fd == -1) {
+        perror("socket");
+        return false;
+    }
+    int flags = fcntl(s->fd, F_GETFL, 0);
+    fcntl(s->fd, F_SETFL, flags | O_NONBLOCK);
+    int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(s->fd, (struct sockaddr *)&bench.addr,
+        sizeof(bench.addr)) == -1 && errno != EINPROGRESS) {
+        close_slot(s);
+        return false;
+    }
+    s->state = SLOT_CONNECTING;
+    set_event(s->fd, EVFILT_WRITE, EV_ADD, s);
+    return true;
+}
+
+/**
+ * Ошибка на слоте: запрос в полёте считается неудачным, соединение
+ * открывается заново
+ * @param s
+ */
+static void fail_slot(struct slot *s) {
+    if (s->state == SLOT_IDLE) {
+        for (int i = 0; i < nidle; i++) {
+            if (idle[i] == (int)(s - slots)) {
+                idle[i] = idle[--nidle];
+                break;
+            }
+        }
+    }
+    if (s->has_request) {
+        result.errors++;
+        inflight--;
+    }
+    close_slot(s);
+    s->has_request = false;
+    if (!bench.close_mode && connect_slot(s))
+        return;
+    make_idle(s);
+}
+
+static void start_request(struct slot *s, uint64_t start_us) {
+    s->has_request = true;
+    s->start_us = start_us;
+    s->req_sent = 0;
+    s->head_len = 0;
+    s->in_body = false;
+    s->server_close = false;
+    inflight++;
+    if (s->fd == -1) {
+        if (!connect_slot(s))
+            fail_slot(s);
+        return;
+    }
+    s->state = SLOT_WRITING;
+    set_event(s->fd, EVFILT_WRITE, EV_ADD, s);
+}
+
+static void finish_request(struct slot *s) {
+    add_sample(now_us() - s->start_us);
+    result.completed++;
+    inflight--;
+    s->has_request = false;
+    if (bench.close_mode || s->server_close) {
+        close_slot(s);
+        /* в режиме keep-alive переподключение не входит в задержку */
+        if (!bench.close_mode && connect_slot(s))
+            return;
+    }
+    make_idle(s);
+}
+
+/**
+ * Разбор заголовков ответа: код, Content-Length и Connection: close
+ * @param s
+ * @param end конец заголовков
+ * @return
+ */
+static bool parse_head(struct slot *s, size_t end) {
+    s->head[end - 1] = '\0';
+    if (s->head_len < 12 || strncmp(s->head, "HTTP/1.", 7) != 0)
+        return false;
+    int status = atoi(s->head + 9);
+    if (status < 200 || status >= 400)
+        result.bad_status++;
+
+    uint64_t content_len = 0;
+    for (char *line = strchr(s->head, '\n'); line; ) {
+        line++;
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            content_len = strtoull(line + 15, NULL, 10);
+        else if (strncasecmp(line, "Connection:", 11) == 0 &&
+                 strncasecmp(line + 11 + strspn(line + 11, " "), "close",
+                     5) == 0)
+            s->server_close = true;
+        line = strchr(line, '\n');
+    }
+    /* тело, пришедшее вместе с заголовками */
+    const uint64_t got = s->head_len - end;
+    s->body_left = content_len > got ? content_len - got : 0;
+    s->in_body = true;
+    return true;
+}
+
+static void handle_write(struct slot *s) {
+    if (s->state == SLOT_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+            err != 0) {
+            fail_slot(s);
+            return;
+        }
+        set_event(s->fd, EVFILT_READ, EV_ADD, s);
+        if (!s->has_request) {
+            set_event(s->fd, EVFILT_WRITE, EV_DELETE, NULL);
+            make_idle(s);
+            return;
+        }
+        s->state = SLOT_WRITING;
+    }
+    if (s->state != SLOT_WRITING)
+        return;
+
+    ssize_t n = send(s->fd, bench.request + s->req_sent,
+        bench.request_len - s->req_sent, 0);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            fail_slot(s);
+        return;
+    }
+    s->req_sent += (size_t)n;
+    if (s->req_sent == bench.request_len) {
+        set_event(s->fd, EVFILT_WRITE, EV_DELETE, NULL);
+        s->state = SLOT_READING;
+    }
+}
+
+static void handle_read(struct slot *s) {
+    static char body[BODY_BUF_SIZE];
+    while (s->fd != -1) {
+        ssize_t n;
+        if (!s->in_body) {
+            n = recv(s->fd, s->head + s->head_len,
+                HEAD_BUF_SIZE - 1 - s->head_len, 0);
+        } else {
+            size_t want = s->body_left < BODY_BUF_SIZE ?
+                (size_t)s->body_left : BODY_BUF_SIZE;
+            n = recv(s->fd, body, want, 0);
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fail_slot(s);
+            return;
+        }
+        if (n == 0 || s->state != SLOT_READING) {
+            /* сервер закрыл соединение или прислал лишнее между
+             * запросами */
+            fail_slot(s);
+            return;
+        }
+        result.bytes += (uint64_t)n;
+
+        if (!s->in_body) {
+            s->head_len += (size_t)n;
+            s->head[s->head_len] = '\0';
+            char *end = strstr(s->head, "\r\n\r\n");
+            if (!end) {
+                if (s->head_len >= HEAD_BUF_SIZE - 1)
+                    fail_slot(s);
+                continue;
+            }
+            if (!parse_head(s, (size_t)(end - s->head) + 4)) {
+                fail_slot(s);
+                return;
+            }
+        } else {
+            s->body_left -= (uint64_t)n;
+        }
+        if (s->in_body && s->body_left == 0) {
+            finish_request(s);
+            return;
+        }
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(double p) {
+    if (result.nsamples == 0)
+        return 0;
+    size_t idx = (size_t)(p * (double)result.nsamples);
+    if (idx >= result.nsamples)
+        idx = result.nsamples - 1;
+    return result.samples[idx];
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Использование: %s -a <адрес:порт> [-u <путь>]"
+                    " [-c <соединений>] [-d <секунд>] [-r <запросов/с>]"
+                    " [-C]\n", prog);
+    fprintf(stderr, "  -r  постоянный темп запросов, задержка считается от"
+                    " запланированного времени отправки\n");
+    fprintf(stderr, "  -C  новое соединение на каждый запрос\n");
+}
+
+static void parse_args(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "a:u:c:d:r:C")) != -1) {
+        switch (opt) {
+            case 'a':
+                bench.host = optarg;
+                break;
+            case 'u':
+                bench.path = optarg;
+                break;
+            case 'c': {
+                char *end;
+                long val = strtol(optarg, &end, 10);
+                if (*end != '\0' || val <= 0 || val > MAX_CONNS) {
+                    fprintf(stderr, "Неверное число соединений '%s'\n",
+                        optarg);
+                    exit(EXIT_FAILURE);
+                }
+                bench.nconns = (int)val;
+                break;
+            }
+            case 'd':
+            case 'r': {
+                char *end;
+                double val = strtod(optarg, &end);
+                if (*end != '\0' || val < 0 || (opt == 'd' && val == 0)) {
+                    fprintf(stderr, "Неверное значение '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (opt == 'd')
+                    bench.duration = val;
+                else
+                    bench.rate = val;
+                break;
+            }
+            case 'C':
+                bench.close_mode = true;
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (!bench.host) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char host[64];
+    const char *colon = strrchr(bench.host, ':');
+    if (!colon || (size_t)(colon - bench.host) >= sizeof(host)) {
+        fprintf(stderr, "Неверный адрес '%s'\n", bench.host);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(host, bench.host, (size_t)(colon - bench.host));
+    host[colon - bench.host] = '\0';
+    bench.addr.sin_family = AF_INET;
+    bench.addr.sin_port = htons((uint16_t)atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &bench.addr.sin_addr) != 1) {
+        fprintf(stderr, "Неверный адрес '%s'\n", bench.host);
+        exit(EXIT_FAILURE);
+    }
+
+    int len = snprintf(bench.request, sizeof(bench.request),
+        "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", bench.path, bench.host,
+        bench.close_mode ? "Connection: close\r\n" : "");
+    if (len < 0 || (size_t)len >= sizeof(bench.request)) {
+        fprintf(stderr, "Слишком длинный путь\n");
+        exit(EXIT_FAILURE);
+    }
+    bench.request_len = (size_t)len;
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        return;
+    rlim_t want = (rlim_t)bench.nconns + 64;
+    if (rl.rlim_cur >= want)
+        return;
+    rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+    setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    kq = kqueue();
+    if (kq == -1)
+        die("kqueue");
+    slots = calloc((size_t)bench.nconns, sizeof(*slots));
+    idle = calloc((size_t)bench.nconns, sizeof(*idle));
+    if (!slots || !idle)
+        die("calloc");
+
+    /* в режиме keep-alive соединения открываются заранее */
+    for (int i = 0; i < bench.nconns; i++) {
+        slots[i].fd = -1;
+        if (bench.close_mode || !connect_slot(&slots[i]))
+            make_idle(&slots[i]);
+    }
+
+    const uint64_t start = now_us();
+    const uint64_t end = start + (uint64_t)(bench.duration * 1e6);
+    const uint64_t total = (uint64_t)(bench.duration * bench.rate);
+    uint64_t issued = 0;
+    struct kevent events[MAX_KEVENTS];
+
+    while (true) {
+        uint64_t now = now_us();
+        const bool running = now < end;
+
+        /* запросы, чьё время наступило, ждут свободного слота. Задержка
+         * отсчитывается от запланированного времени, поэтому очередь
+         * из-за медленного сервера попадает в результат */
+        uint64_t deadline = running ? end : end + DRAIN_TIMEOUT_US;
+        if (bench.rate > 0) {
+            uint64_t due = (uint64_t)((double)(now - start) * bench.rate /
+                1e6) + 1;
+            if (due > total)
+                due = total;
+            while (issued < due && nidle > 0) {
+                struct slot *s = &slots[idle[--nidle]];
+                start_request(s, start +
+                    (uint64_t)((double)issued * 1e6 / bench.rate));
+                issued++;
+            }
+            /* при отставании ждём освобождения слота, иначе — времени
+             * следующего запроса */
+            if (issued == due && issued < total) {
+                uint64_t next = start +
+                    (uint64_t)((double)issued * 1e6 / bench.rate);
+                if (next < deadline)
+                    deadline = next;
+            }
+        } else if (running) {
+            while (nidle > 0) {
+                struct slot *s = &slots[idle[--nidle]];
+                start_request(s, now);
+                issued++;
+            }
+        }
+
+        if (!running && (inflight == 0 || now >= end + DRAIN_TIMEOUT_US))
+            break;
+
+        const uint64_t wait_us = deadline > now ? deadline - now : 0;
+        struct timespec ts = {
+            .tv_sec = (time_t)(wait_us / 1000000),
+            .tv_nsec = (long)(wait_us % 1000000) * 1000
+        };
+
+        int nev = kevent(kq, NULL, 0, events, MAX_KEVENTS, &ts);
+        if (nev == -1) {
+            if (errno == EINTR) continue;
+            die("kevent");
+        }
+        for (int i = 0; i < nev; i++) {
+            struct slot *s = events[i].udata;
+            if (!s || s->fd == -1 || (int)events[i].ident != s->fd)
+                continue;
+            if (events[i].filter == EVFILT_WRITE)
+                handle_write(s);
+            else if (events[i].filter == EVFILT_READ)
+                handle_read(s);
+        }
+    }
+
+    /* включая досылку ответов после окончания прогона */
+    const double measured = (double)(now_us() - start) / 1e6;
+    qsort(result.samples, result.nsamples, sizeof(uint64_t), cmp_u64);
+
+    printf("Соединений: %d, режим %s, темп ", bench.nconns,
+        bench.close_mode ? "close" : "keep-alive");
+    if (bench.rate > 0)
+        printf("%.0f запросов/с\n", bench.rate);
+    else
+        printf("без ограничения\n");
+    printf("Запросов: %llu за %.2f с, %.1f запросов/с, %.2f МБ/с\n",
+        (unsigned long long)result.completed, measured,
+        (double)result.completed / measured,
+        (double)result.bytes / measured / (1024 * 1024));
+    printf("Ошибок: %llu, ответов не 2xx/3xx: %llu, без ответа: %d",
+        (unsigned long long)result.errors,
+        (unsigned long long)result.bad_status, inflight);
+    if (bench.rate > 0)
+        printf(", не отправлено: %llu",
+            (unsigned long long)(total - issued));
+    printf("\n");
+    printf("Задержка, мкс: p50 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+        (unsigned long long)percentile(0.50),
+        (unsigned long long)percentile(0.99),
+        (unsigned long long)percentile(0.999),
+        (unsigned long long)(result.nsamples ?
+            result.samples[result.nsamples - 1] : 0));
+
+    for (int i = 0; i < bench.nconns; i++)
+        close_slot(&slots[i]);
+    close(kq);
+    free(slots);
+    free(idle);
+    free(result.samples);
+    return result.completed > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
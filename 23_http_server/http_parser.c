@@ -0,0 +1,234 @@
+#include "http_parser.h"
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+void http_request_reset(struct http_request *req) {
+    memset(req, 0, sizeof(*req));
+    req->state = HTTP_PARSE_REQUEST_LINE;
+}
+
+/**
+ * Стартовая строка: метод SP цель SP версия
+ * @param req
+ * @param buf
+ * @param start
+ * @param end
+ * @return
+ */
+static bool parse_request_line(struct http_request *req, const char *buf,
+    size_t start, size_t end) {
+    const char *line = buf + start;
+    const size_t len = end - start;
+
+    const char *sp1 = memchr(line, ' ', len);
+    if (!sp1 || sp1 == line)
+        return false;
+    const size_t method_len = (size_t)(sp1 - line);
+
+    const char *target = sp1 + 1;
+    const char *sp2 = memchr(target, ' ', len - method_len - 1);
+    if (!sp2 || sp2 == target)
+        return false;
+    const size_t target_len = (size_t)(sp2 - target);
+
+    const char *version = sp2 + 1;
+    const size_t version_len = len - method_len - target_len - 2;
+    if (version_len == 0 || memchr(version, ' ', version_len))
+        return false;
+
+    req->method.off = start;
+    req->method.len = method_len;
+    req->target.off = (size_t)(target - buf);
+    req->target.len = target_len;
+    req->version.off = (size_t)(version - buf);
+    req->version.len = version_len;
+    return true;
+}
+
+/**
+ * Заголовок имя: значение. Запоминаются только нужные серверу.
+ * Повторный Content-Length или Transfer-Encoding считается ошибкой
+ * @param req
+ * @param buf
+ * @param start
+ * @param end
+ * @return
+ */
+static bool parse_header(struct http_request *req, const char *buf,
+    size_t start, size_t end) {
+    const char *line = buf + start;
+    const char *colon = memchr(line, ':', end - start);
+    if (!colon || colon == line)
+        return false;
+    const size_t name_len = (size_t)(colon - line);
+
+    size_t v = (size_t)(colon - buf) + 1;
+    size_t v_end = end;
+    while (v < v_end && (buf[v] == ' ' || buf[v] == '\t'))
+        v++;
+    while (v_end > v && (buf[v_end - 1] == ' ' || buf[v_end - 1] == '\t'))
+        v_end--;
+    const struct http_span value = { v, v_end - v };
+
+    struct http_span *dst = NULL;
+    switch (name_len) {
+        case 4:
+            if (strncasecmp(line, "Host", 4) == 0)
+                dst = &req->host;
+            break;
+        case 5:
+            if (strncasecmp(line, "Range", 5) == 0)
+                dst = &req->range;
+            break;
+        case 7:
+            if (strncasecmp(line, "Referer", 7) == 0)
+                dst = &req->referer;
+            break;
+        case 8:
+            if (strncasecmp(line, "If-Range", 8) == 0)
+                dst = &req->if_range;
+            break;
+        case 10:
+            if (strncasecmp(line, "Connection", 10) == 0)
+                dst = &req->connection;
+            else if (strncasecmp(line, "User-Agent", 10) == 0)
+                dst = &req->user_agent;
+            break;
+        case 13:
+            if (strncasecmp(line, "If-None-Match", 13) == 0)
+                dst = &req->if_none_match;
+            break;
+        case 14:
+            if (strncasecmp(line, "Content-Length", 14) == 0)
+                dst = &req->content_length;
+            break;
+        case 15:
+            if (strncasecmp(line, "Accept-Encoding", 15) == 0)
+                dst = &req->accept_encoding;
+            break;
+        case 17:
+            if (strncasecmp(line, "If-Modified-Since", 17) == 0)
+                dst = &req->if_modified_since;
+            else if (strncasecmp(line, "Transfer-Encoding", 17) == 0)
+                dst = &req->transfer_encoding;
+            break;
+        default:
+            break;
+    }
+    /* повтор заголовков кадрирования тела — возможная подмена запроса */
+    if ((dst == &req->content_length || dst == &req->transfer_encoding) &&
+        dst->off != 0)
+        return false;
+    if (dst)
+        *dst = value;
+    return true;
+}
+
+/**
+ * Длина тела из Content-Length: только десятичные цифры
+ * @param req
+ * @param buf
+ * @return
+ */
+static bool parse_content_length(struct http_request *req, const char *buf) {
+    const struct http_span span = req->content_length;
+    if (span.len == 0)
+        return false;
+    size_t value = 0;
+    for (size_t i = 0; i < span.len; i++) {
+        const char c = buf[span.off + i];
+        if (c < '0' || c > '9' || value > (SIZE_MAX - 9) / 10)
+            return false;
+        value = value * 10 + (size_t)(c - '0');
+    }
+    req->body_len = value;
+    return true;
+}
+
+/**
+ * Конец заголовков. Запрос и с Content-Length, и с Transfer-Encoding
+ * отклоняется (RFC 9112, 6.3): длину тела такого запроса стороны могут
+ * понять по-разному
+ * @param req
+ * @param buf
+ * @param next начало тела
+ * @return
+ */
+static bool finish_headers(struct http_request *req, const char *buf,
+    size_t next) {
+    req->len = next;
+    req->state = HTTP_PARSE_DONE;
+    if (req->content_length.off == 0)
+        return true;
+    if (req->transfer_encoding.off != 0 || !parse_content_length(req, buf))
+        return false;
+    if (req->body_len > 0)
+        req->state = HTTP_PARSE_BODY;
+    return true;
+}
+
+enum http_parse_result http_parse(struct http_request *req, const char *buf,
+    size_t len) {
+    while (req->state != HTTP_PARSE_DONE) {
+        /* тело не разбирается, только дожидается целиком */
+        if (req->state == HTTP_PARSE_BODY) {
+            if (len - req->len < req->body_len) {
+                req->scan = len;
+                return HTTP_PARSE_INCOMPLETE;
+            }
+            req->len += req->body_len;
+            req->state = HTTP_PARSE_DONE;
+            break;
+        }
+        const char *nl = memchr(buf + req->scan, '\n', len - req->scan);
+        if (!nl) {
+            req->scan = len;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        const size_t next = (size_t)(nl - buf) + 1;
+        size_t end = next - 1;
+        if (end > req->line_start && buf[end - 1] == '\r')
+            end--;
+
+        if (req->state == HTTP_PARSE_REQUEST_LINE) {
+            /* пустые строки перед запросом допускаются (RFC 9112, 2.2) */
+            if (end > req->line_start) {
+                if (!parse_request_line(req, buf, req->line_start, end))
+                    return HTTP_PARSE_ERROR;
+                req->state = HTTP_PARSE_HEADERS;
+            }
+        } else if (end == req->line_start) {
+            if (!finish_headers(req, buf, next))
+                return HTTP_PARSE_ERROR;
+        } else if (!parse_header(req, buf, req->line_start, end)) {
+            return HTTP_PARSE_ERROR;
+        }
+
+        req->scan = next;
+        req->line_start = next;
+    }
+    return HTTP_PARSE_COMPLETE;
+}
+
+bool http_span_eq(const char *buf, struct http_span span, const char *str) {
+    return strlen(str) == span.len && memcmp(buf + span.off, str, span.len) == 0;
+}
+
+bool http_has_token(const char *buf, struct http_span span,
+    const char *token) {
+    const size_t token_len = strlen(token);
+    const char *p = buf + span.off;
+    const char *end = p + span.len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *t = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != ',')
+            p++;
+        if ((size_t)(p - t) == token_len &&
+            strncasecmp(t, token, token_len) == 0)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,90 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Участок буфера приёма: смещение и длина, без копирования */
+struct http_span {
+    size_t off;
+    size_t len;
+};
+
+enum http_parse_state {
+    HTTP_PARSE_REQUEST_LINE,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_BODY,
+    HTTP_PARSE_DONE
+};
+
+enum http_parse_result {
+    HTTP_PARSE_INCOMPLETE,
+    HTTP_PARSE_COMPLETE,
+    HTTP_PARSE_ERROR
+};
+
+/* Состояние разбора запроса. Между вызовами http_parse сохраняется
+ * позиция, так что каждый байт просматривается один раз */
+struct http_request {
+    enum http_parse_state state;
+    size_t scan;
+    size_t line_start;
+    size_t len;
+    size_t body_len; /* по Content-Length */
+    struct http_span method;
+    struct http_span target;
+    struct http_span version;
+    struct http_span host;
+    struct http_span range;
+    struct http_span if_none_match;
+    struct http_span if_modified_since;
+    struct http_span if_range;
+    struct http_span accept_encoding;
+    struct http_span connection;
+    struct http_span content_length; /* off != 0, если заголовок был */
+    struct http_span transfer_encoding;
+    struct http_span referer;
+    struct http_span user_agent;
+};
+
+/**
+ * Подготовка к разбору нового запроса
+ * @param req
+ */
+void http_request_reset(struct http_request *req);
+
+/**
+ * Продолжение разбора запроса в buf[0..len). Просматриваются только
+ * байты, пришедшие после предыдущего вызова
+ * @param req
+ * @param buf
+ * @param len
+ * @return HTTP_PARSE_COMPLETE, когда прочитаны заголовки и тело длиной
+ * Content-Length (длина запроса вместе с телом в req->len),
+ * HTTP_PARSE_INCOMPLETE или HTTP_PARSE_ERROR. Тело с Transfer-Encoding
+ * не читается: после ответа на такой запрос соединение нужно закрыть
+ */
+enum http_parse_result http_parse(struct http_request *req, const char *buf,
+    size_t len);
+
+/**
+ * Сравнение участка со строкой с учётом регистра
+ * @param buf
+ * @param span
+ * @param str
+ * @return
+ */
+bool http_span_eq(const char *buf, struct http_span span, const char *str);
+
+/**
+ * Проверка наличия токена в списке через запятую без учёта регистра
+ * (Connection: keep-alive, Upgrade)
+ * @param buf
+ * @param span
+ * @param token
+ * @return
+ */
+bool http_has_token(const char *buf, struct http_span span,
+    const char *token);
+
+#endif /* HTTP_PARSER_H */
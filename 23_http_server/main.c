@@ -1,27 +1,125 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <time.h>
 #include <limits.h>
 #include <signal.h>
 #include <getopt.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__linux__)
+#include <sched.h>
+#elif defined(__FreeBSD__)
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
 
-#define MAX_CONN 1024
+#include "access_log.h"
+#include "buf_pool.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "mime.h"
+#include "site_archive.h"
+#include "stats.h"
+#include "timer_wheel.h"
+
+#define MAX_CONN 16384
+#define CONN_SLAB_SIZE 256
+#define MAX_FREE_BUFS 256
 #define RECV_BUF_SIZE 4096
 #define SEND_BUF_SIZE 8192
+#define SEND_BUF_TAIL 64 /* запас под строку Connection и начало тела */
 #define MAX_HEADERS 8192
 #define MAX_KEVENTS 64
+#define ACCEPT_BATCH 64
+#define MAX_CHANGES 256
+#define SENDFILE_CHUNK (1024 * 1024)
+#define MAX_KEEPALIVE_REQUESTS 100
+#define MAX_WORKERS 256
+#define STATS_PATH "/__stats"
+#define HEADER_TIMEOUT_MS 10000 /* на приём заголовков запроса целиком */
+#define IDLE_TIMEOUT_MS 15000   /* простой keep-alive между запросами */
+#define SEND_TIMEOUT_MS 30000   /* без продвижения отправки ответа */
+
+/* Ядро само распределяет соединения между сокетами с SO_REUSEPORT только
+ * в Linux и в FreeBSD (SO_REUSEPORT_LB). В остальных системах воркеры
+ * разделяют один слушающий сокет */
+#if defined(SO_REUSEPORT_LB)
+#define LISTEN_REUSEPORT SO_REUSEPORT_LB
+#elif defined(__linux__) && defined(SO_REUSEPORT)
+#define LISTEN_REUSEPORT SO_REUSEPORT
+#endif
+
+/* Начало заголовка до цифр Content-Length, собирается при компиляции */
+#define STATUS_PREFIX(code, reason, type) \
+    "HTTP/1.1 " #code " " reason "\r\n" \
+    "Content-Type: " type "\r\n" \
+    "Content-Length: "
+#define STATUS_TEMPLATE(code, reason, type) { code, \
+    STATUS_PREFIX(code, reason, type), \
+    sizeof(STATUS_PREFIX(code, reason, type)) - 1, \
+    reason, sizeof(reason) - 1 }
+
+/* Готовые заголовки ответов, которые не зависят от файла: ответы об
+ * ошибках (их тело — текст статуса) и /__stats */
+struct status_template {
+    int code;
+    const char *prefix;
+    size_t prefix_len;
+    const char *reason;
+    size_t reason_len;
+};
+
+enum status_id {
+    STATUS_STATS,
+    STATUS_BAD_REQUEST,
+    STATUS_FORBIDDEN,
+    STATUS_NOT_FOUND,
+    STATUS_METHOD_NOT_ALLOWED,
+    STATUS_PAYLOAD_TOO_LARGE,
+    STATUS_URI_TOO_LONG,
+    STATUS_INTERNAL_ERROR
+};
+
+static const struct status_template status_templates[] = {
+    [STATUS_STATS] = STATUS_TEMPLATE(200, "OK", "text/plain; version=0.0.4"),
+    [STATUS_BAD_REQUEST] = STATUS_TEMPLATE(400, "Bad Request", "text/plain"),
+    [STATUS_FORBIDDEN] = STATUS_TEMPLATE(403, "Forbidden", "text/plain"),
+    [STATUS_NOT_FOUND] = STATUS_TEMPLATE(404, "Not Found", "text/plain"),
+    [STATUS_METHOD_NOT_ALLOWED] = STATUS_TEMPLATE(405, "Method Not Allowed",
+        "text/plain"),
+    [STATUS_PAYLOAD_TOO_LARGE] = STATUS_TEMPLATE(413, "Payload Too Large",
+        "text/plain"),
+    [STATUS_URI_TOO_LONG] = STATUS_TEMPLATE(414, "URI Too Long",
+        "text/plain"),
+    [STATUS_INTERNAL_ERROR] = STATUS_TEMPLATE(500, "Internal Server Error",
+        "text/plain"),
+};
 
 enum conn_state {
     STATE_READING,
@@ -30,47 +128,140 @@ enum conn_state {
     STATE_CLOSING
 };
 
+struct worker;
+
+/* Буферы берутся из пулов воркера только на время запроса, простаивающее
+ * keep-alive соединение их не держит */
 struct connection {
+    struct worker *worker;
+    struct connection *next_free;
     int fd;
     enum conn_state state;
-    char recv_buf[RECV_BUF_SIZE];
+    char *recv_buf;
     size_t recv_len;
+    struct http_request req;
+    bool keep_alive;
+    unsigned requests;
+    struct file_entry *file;
     int file_fd;
     off_t file_offset;
-    size_t file_size;
-    char send_buf[SEND_BUF_SIZE];
+    size_t file_end; /* конец отправляемого диапазона */
+    bool use_sendfile;
+    char *send_buf;
     size_t send_len;
     size_t send_sent;
+    struct timer timer;
+    bool idle; /* ждёт следующего запроса keep-alive */
+    char *body; /* тело ответа, сформированного в памяти */
+    const char *shared_body; /* тело из общей памяти, не освобождается */
+    uint8_t trailer[4]; /* хвост после данных файла (Adler-32 потока zlib) */
+    size_t trailer_len;
+    int status;
+    size_t content_len; /* размер тела ответа для лога */
+    uint32_t peer; /* адрес клиента */
+    uint64_t start_us; /* начало запроса для гистограммы задержек */
 };
 
-static struct {
-    const char *root_dir;
-    const char *listen_addr;
+/* Блок соединений. Блоки не перемещаются и не освобождаются до выхода,
+ * поэтому указатель на соединение в udata kqueue остаётся верным */
+struct conn_slab {
+    struct conn_slab *next;
+    struct connection conns[CONN_SLAB_SIZE];
+};
+
+/* Воркер: отдельный поток со своим kqueue, слушающим сокетом и таблицей
+ * соединений. Между воркерами на пути запроса ничего не разделяется */
+struct worker {
+    int id;
+    pthread_t thread;
     int kq;
     int listen_fd;
-    struct connection conns[MAX_CONN];
+    struct conn_slab *slabs;
+    struct connection *free_conns;
+    struct connection *closed_conns;
     size_t nconns;
+    bool accept_paused;
+    struct buf_pool recv_pool;
+    struct buf_pool send_pool;
+    struct file_cache cache;
+    struct timer_wheel timers;
+    uint64_t now; /* время текущей пачки событий, мс */
+    struct worker_stats stats;
+    struct access_ring *log; /* NULL без -a */
+    struct kevent changes[MAX_CHANGES]; /* изменения до следующего kevent */
+    int nchanges;
+};
+
+static struct {
+    const char *root_dir;
+    const char *archive_path;
+    struct site_archive archive;
+    const char *mime_path;
+    struct mime_map mime;
+    const char *listen_addr;
+    struct sockaddr_in addr;
+    int nworkers;
+    bool pin_cpus;
+    size_t small_file;
+    size_t max_conns;
+    bool batch_changes;
+    const char *access_log_path;
+    struct access_log access_log;
+    struct worker *workers;
+    /* воркеры запущены и ещё не присоединены: освобождать их состояние
+     * при выходе нельзя */
+    atomic_bool workers_running;
 } server;
 
 static void cleanup(void) {
-    if (server.listen_fd != -1) {
-        close(server.listen_fd);
-    }
-    for (size_t i = 0; i < server.nconns; i++) {
-        if (server.conns[i].fd != -1) {
-            close(server.conns[i].fd);
+    if (!server.workers)
+        return;
+    if (server.access_log_path)
+        access_log_close(&server.access_log);
+    if (server.archive_path)
+        site_archive_close(&server.archive);
+    mime_map_destroy(&server.mime);
+    for (int w = 0; w < server.nworkers; w++) {
+        struct worker *worker = &server.workers[w];
+        /* общий слушающий сокет закрывается один раз */
+        if (worker->listen_fd != -1 &&
+            (w == 0 || worker->listen_fd != server.workers[0].listen_fd)) {
+            close(worker->listen_fd);
+        }
+        for (struct conn_slab *slab = worker->slabs; slab; ) {
+            struct conn_slab *next = slab->next;
+            for (size_t i = 0; i < CONN_SLAB_SIZE; i++) {
+                if (slab->conns[i].fd != -1) {
+                    close(slab->conns[i].fd);
+                }
+            }
+            free(slab);
+            slab = next;
         }
-        if (server.conns[i].file_fd != -1) {
-            close(server.conns[i].file_fd);
+        fprintf(stderr, "[INFO] воркер %d: кэш файлов %lu попаданий"
+                        " (%lu из памяти), %lu промахов\n", w,
+            (unsigned long)stats_get(&worker->cache.stats.hits),
+            (unsigned long)stats_get(&worker->cache.stats.mem_hits),
+            (unsigned long)stats_get(&worker->cache.stats.misses));
+        file_cache_destroy(&worker->cache);
+        buf_pool_destroy(&worker->recv_pool);
+        buf_pool_destroy(&worker->send_pool);
+        if (worker->kq != -1) {
+            close(worker->kq);
         }
     }
-    if (server.kq != -1) {
-        close(server.kq);
-    }
 }
 
+/**
+ * Аварийное завершение. Пока работают воркеры, cleanup освободил бы их
+ * соединения, кэши и кольца лога у них из-под рук, поэтому выход идёт
+ * через _exit без обработчиков atexit
+ * @param msg
+ */
 static void die(const char *msg) {
     perror(msg);
+    if (atomic_load(&server.workers_running))
+        _exit(EXIT_FAILURE);
     exit(EXIT_FAILURE);
 }
 
@@ -87,34 +278,211 @@ static int set_nonblocking(int fd) {
     return 0;
 }
 
+static void close_connection(struct connection *conn);
+
 /**
- * Регистрация интересов
+ * Ошибка изменения из пачки, о которой kqueue сообщил событием EV_ERROR.
+ * Ошибки снятия интересов безразличны, а соединение, для которого не
+ * удалось зарегистрировать интерес, закрывается
+ * @param w
+ * @param ev
+ */
+static void handle_change_error(struct worker *w, const struct kevent *ev) {
+    if (ev->data == 0)
+        return;
+    if (ev->ident == (uintptr_t)w->listen_fd) {
+        errno = (int)ev->data;
+        perror("kevent listen");
+        return;
+    }
+    struct connection *conn = ev->udata;
+    if (conn && conn->fd == (int)ev->ident)
+        close_connection(conn);
+}
+
+/**
+ * Применение накопленных изменений без ожидания событий
+ * @param w
+ * @return -1, если хотя бы одно изменение не применилось
+ */
+static int flush_changes(struct worker *w) {
+    if (w->nchanges == 0)
+        return 0;
+    struct kevent results[MAX_CHANGES];
+    const int nchanges = w->nchanges;
+    for (int i = 0; i < nchanges; i++)
+        w->changes[i].flags |= EV_RECEIPT;
+    w->nchanges = 0;
+    const struct timespec zero = {0, 0};
+    int n = kevent(w->kq, w->changes, nchanges, results, nchanges, &zero);
+    if (n == -1)
+        return -1;
+    int rc = 0;
+    for (int i = 0; i < n; i++) {
+        if ((results[i].flags & EV_ERROR) && results[i].data != 0) {
+            handle_change_error(w, &results[i]);
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+/**
+ * Изменение интереса. В режиме пачек (-e batch) изменение копится в
+ * changelist воркера и уходит в ядро вместе со следующим ожиданием
+ * событий, так что на запрос не тратится отдельных системных вызовов, а
+ * ошибки приходят событиями EV_ERROR. В режиме direct изменение
+ * применяется сразу
+ * @param w
  * @param fd
  * @param filter
+ * @param flags
  * @param udata
  */
-static int add_kqueue_event(int fd, int filter, void *udata) {
+static int change_event(struct worker *w, int fd, int filter, int flags,
+    void *udata) {
+    if (server.batch_changes) {
+        /* ошибки из переполненной пачки уже разобраны flush_changes */
+        if (w->nchanges == MAX_CHANGES)
+            flush_changes(w);
+        EV_SET(&w->changes[w->nchanges], fd, filter, flags, 0, 0, udata);
+        w->nchanges++;
+        return 0;
+    }
     struct kevent ev = {0};
-    EV_SET(&ev, fd, filter, EV_ADD | EV_ENABLE, 0, 0, udata);
-    if (kevent(server.kq, &ev, 1, NULL, 0, NULL) == -1)
+    EV_SET(&ev, fd, filter, flags, 0, 0, udata);
+    if (kevent(w->kq, &ev, 1, NULL, 0, NULL) == -1)
         return -1;
     return 0;
 }
 
-static int mod_kqueue_event(int fd, int filter, void *udata) {
-    struct kevent ev = {0};
-    EV_SET(&ev, fd, filter, EV_ADD | EV_ENABLE, 0, 0, udata);
-    if (kevent(server.kq, &ev, 1, NULL, 0, NULL) == -1)
-        return -1;
-    return 0;
+/**
+ * Отбрасывание накопленных изменений для закрываемого дескриптора:
+ * close сам снимает его интересы, а номер может сразу достаться новому
+ * соединению
+ * @param w
+ * @param fd
+ */
+static void drop_changes(struct worker *w, int fd) {
+    int j = 0;
+    for (int i = 0; i < w->nchanges; i++) {
+        if (w->changes[i].ident != (uintptr_t)fd)
+            w->changes[j++] = w->changes[i];
+    }
+    w->nchanges = j;
 }
 
-static int del_kqueue_event(int fd, int filter) {
-    struct kevent ev = {0};
-    EV_SET(&ev, fd, filter, EV_DELETE, 0, 0, NULL);
-    if (kevent(server.kq, &ev, 1, NULL, 0, NULL) == -1)
-        return -1;
-    return 0;
+/**
+ * Регистрация интересов
+ * @param w
+ * @param fd
+ * @param filter
+ * @param udata
+ */
+static int add_kqueue_event(struct worker *w, int fd, int filter,
+    void *udata) {
+    return change_event(w, fd, filter, EV_ADD | EV_ENABLE, udata);
+}
+
+static int mod_kqueue_event(struct worker *w, int fd, int filter,
+    void *udata) {
+    return change_event(w, fd, filter, EV_ADD | EV_ENABLE, udata);
+}
+
+static int del_kqueue_event(struct worker *w, int fd, int filter) {
+    return change_event(w, fd, filter, EV_DELETE, NULL);
+}
+
+/**
+ * Включение или отключение интереса без снятия регистрации
+ * @param w
+ * @param fd
+ * @param filter
+ * @param enable
+ */
+static int toggle_kqueue_event(struct worker *w, int fd, int filter,
+    bool enable) {
+    return change_event(w, fd, filter, enable ? EV_ENABLE : EV_DISABLE,
+        NULL);
+}
+
+/**
+ * Выделение соединения из свободного списка. Когда список пуст,
+ * добавляется новый блок на CONN_SLAB_SIZE соединений
+ * @param w
+ * @return соединение или NULL
+ */
+static struct connection *alloc_connection(struct worker *w) {
+    if (!w->free_conns) {
+        struct conn_slab *slab = malloc(sizeof(*slab));
+        if (!slab)
+            return NULL;
+        slab->next = w->slabs;
+        w->slabs = slab;
+        for (size_t i = CONN_SLAB_SIZE; i > 0; i--) {
+            struct connection *c = &slab->conns[i - 1];
+            c->fd = -1;
+            c->next_free = w->free_conns;
+            w->free_conns = c;
+        }
+    }
+    struct connection *conn = w->free_conns;
+    w->free_conns = conn->next_free;
+    w->nconns++;
+    return conn;
+}
+
+/**
+ * Возврат соединения в свободный список
+ * @param w
+ * @param conn
+ */
+static void release_connection(struct worker *w, struct connection *conn) {
+    conn->next_free = w->free_conns;
+    w->free_conns = conn;
+    w->nconns--;
+}
+
+/**
+ * Выдача буферов приёма и отправки на время обработки запроса
+ * @param conn
+ * @return false при нехватке памяти
+ */
+static bool acquire_buffers(struct connection *conn) {
+    if (!conn->recv_buf) {
+        conn->recv_buf = buf_pool_get(&conn->worker->recv_pool);
+        if (!conn->recv_buf)
+            return false;
+        conn->recv_buf[0] = '\0';
+    }
+    if (!conn->send_buf) {
+        conn->send_buf = buf_pool_get(&conn->worker->send_pool);
+        if (!conn->send_buf)
+            return false;
+    }
+    return true;
+}
+
+static void release_buffers(struct connection *conn) {
+    if (conn->recv_buf) {
+        buf_pool_put(&conn->worker->recv_pool, conn->recv_buf);
+        conn->recv_buf = NULL;
+    }
+    if (conn->send_buf) {
+        buf_pool_put(&conn->worker->send_pool, conn->send_buf);
+        conn->send_buf = NULL;
+    }
+}
+
+/**
+ * Перезапуск таймера соединения. Срок отсчитывается от времени текущей
+ * пачки событий
+ * @param conn
+ * @param timeout_ms
+ */
+static void set_timeout(struct connection *conn, uint64_t timeout_ms) {
+    timer_set(&conn->worker->timers, &conn->timer, conn->worker->now,
+        timeout_ms);
 }
 
 /**
@@ -122,197 +490,1197 @@ static int del_kqueue_event(int fd, int filter) {
  * @param conn
  */
 static void close_connection(struct connection *conn) {
-    del_kqueue_event(conn->fd, EVFILT_READ);
-    del_kqueue_event(conn->fd, EVFILT_WRITE);
+    if (conn->fd == -1)
+        return;
+    del_kqueue_event(conn->worker, conn->fd, EVFILT_READ);
+    del_kqueue_event(conn->worker, conn->fd, EVFILT_WRITE);
+    drop_changes(conn->worker, conn->fd);
     close(conn->fd);
-    if (conn->file_fd != -1) {
-        close(conn->file_fd);
-        conn->file_fd = -1;
+    timer_cancel(&conn->worker->timers, &conn->timer);
+    stats_add(&conn->worker->stats.closes, 1);
+    free(conn->body);
+    conn->body = NULL;
+    conn->shared_body = NULL;
+    if (conn->file) {
+        file_cache_release(&conn->worker->cache, conn->file);
+        conn->file = NULL;
+    }
+    conn->file_fd = -1;
+    release_buffers(conn);
+    conn->fd = -1;
+    conn->state = STATE_CLOSING;
+    /* в свободный список после обработки текущей пачки событий */
+    conn->next_free = conn->worker->closed_conns;
+    conn->worker->closed_conns = conn;
+}
+
+/**
+ * MIME-тип участника архива по имени
+ * @param path
+ * @return
+ */
+static const char *get_mime_type(const char *path) {
+    return mime_lookup(&server.mime, path)->name;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Декодирование пути из цели запроса, строка запроса после '?'
+ * отбрасывается
+ * @param dst
+ * @param dst_size
+ * @param src
+ * @param src_len
+ * @return false, если путь не помещается в dst
+ */
+static bool url_decode(char *dst, size_t dst_size, const char *src,
+    size_t src_len) {
+    char *d = dst;
+    const char *ptr = src;
+    const char *end = src + src_len;
+    while (ptr < end && *ptr != '?') {
+        if (d - dst >= (ptrdiff_t)dst_size - 1)
+            return false;
+        if (*ptr == '%' && end - ptr >= 3) {
+            const int hi = hex_value(ptr[1]);
+            const int lo = hex_value(ptr[2]);
+            if (hi >= 0 && lo >= 0) {
+                *d = (char)(hi << 4 | lo);
+                d++;
+                ptr += 3;
+                continue;
+            }
+        } else if (*ptr == '+') {
+            *d = ' ';
+            d++;
+            ptr++;
+            continue;
+        }
+        *d = *ptr;
+        d++;
+        ptr++;
+    }
+    *d = '\0';
+    return true;
+}
+
+static bool is_safe_path(const char *path) {
+    if (strstr(path, "..") != NULL) return false;
+    return true;
+}
+
+/**
+ * Завершение заголовка в send_buf строкой Connection и пустой строкой
+ * @param conn
+ */
+static void finish_header(struct connection *conn) {
+    static const char keep_alive[] = "Connection: keep-alive\r\n\r\n";
+    static const char close_conn[] = "Connection: close\r\n\r\n";
+    const char *tail = conn->keep_alive ? keep_alive : close_conn;
+    const size_t tail_len = conn->keep_alive ? sizeof(keep_alive) - 1
+                                             : sizeof(close_conn) - 1;
+
+    memcpy(conn->send_buf + conn->send_len, tail, tail_len);
+    conn->send_len += tail_len;
+    conn->send_sent = 0;
+    conn->state = STATE_SENDING_HEADER;
+}
+
+/**
+ * Поместился ли заголовок, сформированный snprintf в send_buf, вместе
+ * с запасом для finish_header
+ * @param written результат snprintf
+ * @return
+ */
+static bool header_fits(int written) {
+    return written >= 0 && (size_t)written < SEND_BUF_SIZE - SEND_BUF_TAIL;
+}
+
+/**
+ * Запись размера десятичными цифрами
+ * @param dst
+ * @param value
+ * @return число записанных символов
+ */
+static size_t format_size(char *dst, size_t value) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    for (size_t i = 0; i < n; i++)
+        dst[i] = digits[n - 1 - i];
+    return n;
+}
+
+/**
+ * Заголовок из готового шаблона: дописываются только цифры
+ * Content-Length и строка Connection
+ * @param conn
+ * @param t
+ * @param content_len
+ */
+static void build_status_header(struct connection *conn,
+    const struct status_template *t, size_t content_len) {
+    memcpy(conn->send_buf, t->prefix, t->prefix_len);
+    conn->send_len = t->prefix_len;
+    conn->send_len += format_size(conn->send_buf + conn->send_len,
+        content_len);
+    conn->send_buf[conn->send_len++] = '\r';
+    conn->send_buf[conn->send_len++] = '\n';
+    conn->status = t->code;
+    conn->content_len = content_len;
+    finish_header(conn);
+}
+
+static void send_error(struct connection *conn, enum status_id id) {
+    const struct status_template *t = &status_templates[id];
+    /* после ошибок разбора границы следующего запроса не известны */
+    if (t->code == 400 || t->code == 413 || t->code >= 500)
+        conn->keep_alive = false;
+    build_status_header(conn, t, t->reason_len);
+    memcpy(conn->send_buf + conn->send_len, t->reason, t->reason_len);
+    conn->send_len += t->reason_len;
+    if (mod_kqueue_event(conn->worker, conn->fd, EVFILT_WRITE, conn) == -1) {
+        /* Не удалось зарегистрировать событие — закрываем соединение */
+        close_connection(conn);
+    }
+}
+
+/**
+ * Заголовок ответа 200 из заготовки в записи кэша
+ * @param conn
+ * @param file
+ */
+static void build_file_header(struct connection *conn,
+    const struct file_entry *file) {
+    memcpy(conn->send_buf, file->header, file->header_len);
+    conn->send_len = file->header_len;
+    conn->status = 200;
+    conn->content_len = file->size;
+    finish_header(conn);
+}
+
+/**
+ * Заголовок ответа 206 на запрос диапазона [start, end)
+ * @param conn
+ * @param file
+ * @param start
+ * @param end
+ * @return false, если заголовок не поместился в send_buf
+ */
+static bool build_range_header(struct connection *conn,
+    const struct file_entry *file, size_t start, size_t end) {
+    const int written = snprintf(conn->send_buf, SEND_BUF_SIZE,
+        "HTTP/1.1 206 Partial Content\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Content-Range: bytes %zu-%zu/%zu\r\n"
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "Accept-Ranges: bytes\r\n",
+        file->mime, end - start, start, end - 1, file->size, file->etag,
+        file->last_modified);
+    if (!header_fits(written))
+        return false;
+    conn->send_len = (size_t)written;
+    conn->status = 206;
+    conn->content_len = end - start;
+    finish_header(conn);
+    return true;
+}
+
+/**
+ * Заголовок ответа 304 без тела. Vary повторяет ответ 200, чтобы кэши
+ * не путали сжатые и несжатые варианты
+ * @param conn
+ * @param file
+ * @return false, если заголовок не поместился в send_buf
+ */
+static bool build_not_modified_header(struct connection *conn,
+    const struct file_entry *file) {
+    const int written = snprintf(conn->send_buf, SEND_BUF_SIZE,
+        "HTTP/1.1 304 Not Modified\r\n"
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "%s",
+        file->etag, file->last_modified,
+        file->vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (!header_fits(written))
+        return false;
+    conn->send_len = (size_t)written;
+    conn->status = 304;
+    conn->content_len = 0;
+    finish_header(conn);
+    return true;
+}
+
+/**
+ * Ответ 416 на диапазон за пределами файла
+ * @param conn
+ * @param file
+ */
+static void send_range_not_satisfiable(struct connection *conn,
+    const struct file_entry *file) {
+    static const char body[] = "Range Not Satisfiable";
+    const int written = snprintf(conn->send_buf, SEND_BUF_SIZE,
+        "HTTP/1.1 416 Range Not Satisfiable\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %zu\r\n"
+        "Content-Range: bytes */%zu\r\n",
+        sizeof(body) - 1, file->size);
+    if (!header_fits(written)) {
+        send_error(conn, STATUS_INTERNAL_ERROR);
+        return;
+    }
+    conn->send_len = (size_t)written;
+    conn->status = 416;
+    conn->content_len = sizeof(body) - 1;
+    finish_header(conn);
+    memcpy(conn->send_buf + conn->send_len, body, sizeof(body) - 1);
+    conn->send_len += sizeof(body) - 1;
+    if (mod_kqueue_event(conn->worker, conn->fd, EVFILT_WRITE, conn) == -1)
+        close_connection(conn);
+}
+
+/**
+ * Открытие файла при промахе кэша: open и fstat вместо stat, access и
+ * open. O_NONBLOCK не даёт зависнуть на FIFO
+ * @param conn
+ * @param decoded_path
+ * @param mime
+ * @param vary У файла могут быть сжатые копии
+ * @return запись кэша или NULL, если ответ об ошибке уже сформирован
+ */
+static struct file_entry *open_file(struct connection *conn,
+    const char *decoded_path, const char *mime, bool vary) {
+    char full_path[PATH_MAX];
+    int written = snprintf(full_path, sizeof(full_path), "%s/%s",
+        server.root_dir, decoded_path);
+    if (written < 0 || (size_t)written >= sizeof(full_path)) {
+        send_error(conn, STATUS_URI_TOO_LONG);
+        return NULL;
+    }
+
+    int file_fd = open(full_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (file_fd == -1) {
+        if (errno == ENOENT || errno == ENOTDIR)
+            send_error(conn, STATUS_NOT_FOUND);
+        else if (errno == EACCES)
+            send_error(conn, STATUS_FORBIDDEN);
+        else if (errno == ENAMETOOLONG)
+            send_error(conn, STATUS_URI_TOO_LONG);
+        else
+            send_error(conn, STATUS_INTERNAL_ERROR);
+        return NULL;
+    }
+
+    struct stat st = {0};
+    if (fstat(file_fd, &st) == -1) {
+        close(file_fd);
+        send_error(conn, STATUS_INTERNAL_ERROR);
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(file_fd);
+        send_error(conn, STATUS_NOT_FOUND);
+        return NULL;
+    }
+
+    struct file_entry *file = file_cache_insert(&conn->worker->cache,
+        decoded_path, FILE_ENC_IDENTITY, file_fd, &st, mime, vary);
+    if (!file) {
+        close(file_fd);
+        send_error(conn, STATUS_INTERNAL_ERROR);
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * Проверка Accept-Encoding: кодирование указано явно или через *, и его
+ * вес не q=0
+ * @param buf
+ * @param list
+ * @param coding
+ * @return
+ */
+static bool accepts_encoding(const char *buf, struct http_span list,
+    const char *coding) {
+    const size_t coding_len = strlen(coding);
+    const char *p = buf + list.off;
+    const char *end = p + list.len;
+    bool accepted = false;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        const size_t name_len = (size_t)(p - name);
+
+        /* параметры до следующей запятой, интересен только q */
+        bool zero_q = false;
+        while (p < end && *p != ',') {
+            if ((*p == 'q' || *p == 'Q') && end - p >= 3 && p[1] == '=') {
+                const char *q = p + 2;
+                zero_q = *q == '0';
+                for (q++; zero_q && q < end && *q != ',' && *q != ';'; q++) {
+                    if (*q != '.' && *q != '0' && *q != ' ')
+                        zero_q = false;
+                }
+            }
+            p++;
+        }
+
+        if (name_len == coding_len && strncasecmp(name, coding, name_len) == 0)
+            return !zero_q;
+        if (name_len == 1 && *name == '*')
+            accepted = !zero_q;
+    }
+    return accepted;
+}
+
+/**
+ * Поиск сжатой копии файла (file.br или file.gz) в кэше или на диске.
+ * Отсутствие копии тоже кэшируется
+ * @param conn
+ * @param decoded_path
+ * @param encoding
+ * @param mime
+ * @return захваченная запись с открытой копией или NULL
+ */
+static struct file_entry *open_sidecar(struct connection *conn,
+    const char *decoded_path, enum file_encoding encoding, const char *mime) {
+    struct file_cache *cache = &conn->worker->cache;
+    struct file_entry *file = file_cache_lookup(cache, decoded_path, encoding);
+    if (!file) {
+        char full_path[PATH_MAX];
+        int written = snprintf(full_path, sizeof(full_path), "%s/%s%s",
+            server.root_dir, decoded_path,
+            encoding == FILE_ENC_BR ? ".br" : ".gz");
+        int fd = -1;
+        struct stat st = {0};
+        if (written > 0 && (size_t)written < sizeof(full_path))
+            fd = open(full_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            file = file_cache_insert_missing(cache, decoded_path, encoding);
+        } else {
+            file = file_cache_insert(cache, decoded_path, encoding, fd, &st,
+                mime, true);
+            if (!file)
+                close(fd);
+        }
+        if (!file)
+            return NULL;
+    }
+    if (file->fd == -1) {
+        file_cache_release(cache, file);
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * Определение, остаётся ли соединение открытым после ответа: HTTP/1.1
+ * держит его по умолчанию, HTTP/1.0 только с Connection: keep-alive.
+ * Тело с Transfer-Encoding не читается, и после ответа соединение
+ * закрывается, иначе байты тела были бы разобраны как следующий запрос
+ * @param conn
+ */
+static void update_keep_alive(struct connection *conn) {
+    const struct http_request *req = &conn->req;
+    const bool has_conn = req->connection.len > 0;
+
+    if (http_span_eq(conn->recv_buf, req->version, "HTTP/1.1"))
+        conn->keep_alive = !has_conn ||
+            !http_has_token(conn->recv_buf, req->connection, "close");
+    else
+        conn->keep_alive = has_conn &&
+            http_has_token(conn->recv_buf, req->connection, "keep-alive");
+
+    conn->requests++;
+    if (conn->requests >= MAX_KEEPALIVE_REQUESTS ||
+        req->transfer_encoding.off != 0)
+        conn->keep_alive = false;
+}
+
+/**
+ * Сравнение со списком ETag из If-None-Match. Для GET применяется слабое
+ * сравнение, так что префикс W/ не учитывается
+ * @param buf
+ * @param list
+ * @param etag
+ * @return
+ */
+static bool etag_matches(const char *buf, struct http_span list,
+    const char *etag) {
+    const size_t etag_len = strlen(etag);
+    const char *p = buf + list.off;
+    const char *end = p + list.len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (end - p >= 1 && *p == '*')
+            return true;
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/')
+            p += 2;
+        const char *t = p;
+        while (p < end && *p != ',')
+            p++;
+        const char *t_end = p;
+        while (t_end > t && (t_end[-1] == ' ' || t_end[-1] == '\t'))
+            t_end--;
+        if ((size_t)(t_end - t) == etag_len && memcmp(t, etag, etag_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Разбор HTTP-даты (IMF-fixdate)
+ * @param buf
+ * @param span
+ * @param out
+ * @return false, если дата не разобрана
+ */
+static bool parse_http_date(const char *buf, struct http_span span,
+    time_t *out) {
+    char date[64];
+    if (span.len == 0 || span.len >= sizeof(date))
+        return false;
+    memcpy(date, buf + span.off, span.len);
+    date[span.len] = '\0';
+    struct tm tm = {0};
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0')
+        return false;
+    *out = timegm(&tm);
+    return true;
+}
+
+/**
+ * Условный GET: If-None-Match, а без него If-Modified-Since
+ * @param conn
+ * @param file
+ * @return true, если у клиента актуальная копия и нужен ответ 304
+ */
+static bool is_not_modified(const struct connection *conn,
+    const struct file_entry *file) {
+    const struct http_request *req = &conn->req;
+    if (req->if_none_match.len > 0)
+        return etag_matches(conn->recv_buf, req->if_none_match, file->etag);
+    if (req->if_modified_since.len > 0) {
+        time_t since;
+        if (http_span_eq(conn->recv_buf, req->if_modified_since,
+            file->last_modified))
+            return true;
+        if (parse_http_date(conn->recv_buf, req->if_modified_since, &since))
+            return file->mtime <= since;
+    }
+    return false;
+}
+
+enum range_result {
+    RANGE_NONE,
+    RANGE_OK,
+    RANGE_UNSATISFIABLE
+};
+
+static bool parse_size(const char **p, const char *end, size_t *out) {
+    if (*p == end || **p < '0' || **p > '9')
+        return false;
+    size_t v = 0;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        const size_t digit = (size_t)(**p - '0');
+        if (v > (SIZE_MAX - digit) / 10)
+            return false;
+        v = v * 10 + digit;
+        (*p)++;
+    }
+    *out = v;
+    return true;
+}
+
+/**
+ * Разбор Range: bytes=a-b, bytes=a- или bytes=-n. Несколько диапазонов и
+ * нераспознанный синтаксис игнорируются, отдаётся весь файл
+ * @param conn
+ * @param file
+ * @param start
+ * @param end Конец диапазона (не включая)
+ * @return
+ */
+static enum range_result parse_range(const struct connection *conn,
+    const struct file_entry *file, size_t *start, size_t *end) {
+    const struct http_request *req = &conn->req;
+    if (req->range.len == 0)
+        return RANGE_NONE;
+    /* If-Range с устаревшим валидатором: клиенту нужен весь файл */
+    if (req->if_range.len > 0 &&
+        !http_span_eq(conn->recv_buf, req->if_range, file->etag) &&
+        !http_span_eq(conn->recv_buf, req->if_range, file->last_modified))
+        return RANGE_NONE;
+
+    const char *p = conn->recv_buf + req->range.off;
+    const char *p_end = p + req->range.len;
+    if (req->range.len < 6 || strncmp(p, "bytes=", 6) != 0)
+        return RANGE_NONE;
+    p += 6;
+    if (memchr(p, ',', (size_t)(p_end - p)))
+        return RANGE_NONE;
+
+    size_t first = 0;
+    size_t last = 0;
+    if (p < p_end && *p == '-') {
+        p++;
+        size_t suffix;
+        if (!parse_size(&p, p_end, &suffix) || p != p_end)
+            return RANGE_NONE;
+        if (suffix == 0 || file->size == 0)
+            return RANGE_UNSATISFIABLE;
+        first = suffix < file->size ? file->size - suffix : 0;
+        last = file->size - 1;
+    } else {
+        if (!parse_size(&p, p_end, &first) || p == p_end || *p != '-')
+            return RANGE_NONE;
+        p++;
+        if (p == p_end) {
+            last = file->size - 1;
+        } else if (!parse_size(&p, p_end, &last) || p != p_end ||
+            last < first) {
+            return RANGE_NONE;
+        }
+        if (first >= file->size)
+            return RANGE_UNSATISFIABLE;
+        if (last >= file->size)
+            last = file->size - 1;
+    }
+
+    *start = first;
+    *end = last + 1;
+    return RANGE_OK;
+}
+
+/**
+ * Ответ участником архива сайта. Несжатый участник, а для клиента,
+ * принимающего deflate, и сжатый уходят из файла архива через sendfile:
+ * сжатые данные дополняются заголовком zlib за заголовком ответа и
+ * Adler-32 после тела. Клиенту без deflate участник отдаётся из памяти:
+ * распакованным при открытии архива или, если не поместился в кэш архива,
+ * распакованным на этот запрос
+ * @param conn
+ * @param m
+ */
+static void send_archive_member(struct connection *conn,
+    const struct site_member *m) {
+    const struct http_request *req = &conn->req;
+    const struct file_entry *file = &m->identity;
+    if (m->deflated.size > 0 && req->accept_encoding.len > 0 &&
+        accepts_encoding(conn->recv_buf, req->accept_encoding, "deflate"))
+        file = &m->deflated;
+
+    if (is_not_modified(conn, file)) {
+        if (!build_not_modified_header(conn, file))
+            send_error(conn, STATUS_INTERNAL_ERROR);
+        else if (mod_kqueue_event(conn->worker, conn->fd, EVFILT_WRITE,
+            conn) == -1)
+            close_connection(conn);
+        return;
+    }
+
+    /* поток zlib отдаётся только целиком */
+    size_t start = 0;
+    size_t end = file->size;
+    const enum range_result range = file == &m->deflated ? RANGE_NONE :
+        parse_range(conn, file, &start, &end);
+    if (range == RANGE_UNSATISFIABLE) {
+        send_range_not_satisfiable(conn, file);
+        return;
+    }
+    if (range == RANGE_OK) {
+        if (!build_range_header(conn, file, start, end)) {
+            send_error(conn, STATUS_INTERNAL_ERROR);
+            return;
+        }
+    } else {
+        build_file_header(conn, file);
+    }
+    if (file->in_memory) {
+        conn->shared_body = file->data;
+    } else if (file->fd == -1) {
+        conn->body = site_archive_inflate(m);
+        if (!conn->body) {
+            send_error(conn, STATUS_INTERNAL_ERROR);
+            return;
+        }
+    }
+
+    if (conn->body || conn->shared_body) {
+        conn->file_offset = (off_t)start;
+        conn->file_end = end;
+    } else {
+        if (file == &m->deflated) {
+            /* CMF/FLG: deflate с окном 32 КБ без словаря */
+            conn->send_buf[conn->send_len++] = 0x78;
+            conn->send_buf[conn->send_len++] = 0x01;
+            conn->trailer[0] = (uint8_t)(m->adler >> 24);
+            conn->trailer[1] = (uint8_t)(m->adler >> 16);
+            conn->trailer[2] = (uint8_t)(m->adler >> 8);
+            conn->trailer[3] = (uint8_t)m->adler;
+            conn->trailer_len = sizeof(conn->trailer);
+            end = m->data_len;
+        }
+        conn->file_fd = file->fd;
+        conn->file_offset = file->offset + (off_t)start;
+        conn->file_end = (size_t)file->offset + end;
+    }
+    if (mod_kqueue_event(conn->worker, conn->fd, EVFILT_WRITE, conn) == -1)
+        close_connection(conn);
+}
+
+/**
+ * Ответ со счётчиками всех воркеров. Счётчики других воркеров читаются
+ * без блокировок, поэтому значения разных метрик могут слегка
+ * расходиться во времени
+ * @param conn
+ */
+static void send_stats(struct connection *conn) {
+    const struct worker_stats *workers[MAX_WORKERS];
+    const struct cache_stats *caches[MAX_WORKERS];
+    for (int i = 0; i < server.nworkers; i++) {
+        workers[i] = &server.workers[i].stats;
+        caches[i] = &server.workers[i].cache.stats;
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out) {
+        send_error(conn, STATUS_INTERNAL_ERROR);
+        return;
+    }
+    stats_render(out, workers, caches, server.nworkers);
+    if (fclose(out) != 0) {
+        free(body);
+        send_error(conn, STATUS_INTERNAL_ERROR);
+        return;
+    }
+
+    build_status_header(conn, &status_templates[STATUS_STATS], body_len);
+    conn->body = body;
+    conn->file_offset = 0;
+    conn->file_end = body_len;
+    if (mod_kqueue_event(conn->worker, conn->fd, EVFILT_WRITE, conn) == -1)
+        close_connection(conn);
+}
+
+static void handle_request(struct connection *conn) {
+    const struct http_request *req = &conn->req;
+    update_keep_alive(conn);
+    if (!http_span_eq(conn->recv_buf, req->method, "GET")) {
+        send_error(conn, STATUS_METHOD_NOT_ALLOWED);
+        return;
+    }
+
+    if (http_span_eq(conn->recv_buf, req->target, STATS_PATH)) {
+        send_stats(conn);
+        return;
+    }
+
+    char decoded_path[1024];
+    if (!url_decode(decoded_path, sizeof(decoded_path),
+        conn->recv_buf + req->target.off, req->target.len)) {
+        send_error(conn, STATUS_URI_TOO_LONG);
+        return;
+    }
+
+    if (!is_safe_path(decoded_path)) {
+        send_error(conn, STATUS_FORBIDDEN);
+        return;
+    }
+
+    /* архив сайта проверяется первым, каталог -d дополняет его */
+    if (server.archive_path) {
+        const struct site_member *m = site_archive_find(&server.archive,
+            decoded_path);
+        if (m) {
+            send_archive_member(conn, m);
+            return;
+        }
+        if (!server.root_dir) {
+            send_error(conn, STATUS_NOT_FOUND);
+            return;
+        }
+    }
+
+    const struct mime_type *type = mime_lookup(&server.mime, decoded_path);
+    const char *mime = type->name;
+    const bool vary = type->compressible;
+    struct file_entry *file = NULL;
+    if (vary && req->accept_encoding.len > 0) {
+        if (accepts_encoding(conn->recv_buf, req->accept_encoding, "br"))
+            file = open_sidecar(conn, decoded_path, FILE_ENC_BR, mime);
+        if (!file &&
+            accepts_encoding(conn->recv_buf, req->accept_encoding, "gzip"))
+            file = open_sidecar(conn, decoded_path, FILE_ENC_GZIP, mime);
+    }
+    if (!file)
+        file = file_cache_lookup(&conn->worker->cache, decoded_path,
+            FILE_ENC_IDENTITY);
+    if (!file) {
+        file = open_file(conn, decoded_path, mime, vary);
+        if (!file)
+            return;
+    }
+
+    if (is_not_modified(conn, file)) {
+        const bool built = build_not_modified_header(conn, file);
+        file_cache_release(&conn->worker->cache, file);
+        if (!built)
+            send_error(conn, STATUS_INTERNAL_ERROR);
+        else if (mod_kqueue_event(conn->worker, conn->fd, EVFILT_WRITE,
+            conn) == -1)
+            close_connection(conn);
+        return;
+    }
+
+    size_t start = 0;
+    size_t end = file->size;
+    switch (parse_range(conn, file, &start, &end)) {
+        case RANGE_NONE:
+            build_file_header(conn, file);
+            break;
+        case RANGE_OK:
+            if (!build_range_header(conn, file, start, end)) {
+                file_cache_release(&conn->worker->cache, file);
+                send_error(conn, STATUS_INTERNAL_ERROR);
+                return;
+            }
+            break;
+        case RANGE_UNSATISFIABLE:
+            send_range_not_satisfiable(conn, file);
+            file_cache_release(&conn->worker->cache, file);
+            return;
+    }
+
+    conn->file = file;
+    conn->file_fd = file->fd;
+    conn->file_offset = (off_t)start;
+    conn->file_end = end;
+    if (mod_kqueue_event(conn->worker, conn->fd, EVFILT_WRITE, conn) == -1) {
+        close_connection(conn);
+    }
+}
+
+/**
+ * Не поместится ли недочитанный запрос в буфер приёма. Тело по
+ * Content-Length пропускается только целиком из буфера
+ * @param conn
+ * @return
+ */
+static bool request_too_large(const struct connection *conn) {
+    if (conn->req.state == HTTP_PARSE_BODY)
+        return conn->req.body_len > RECV_BUF_SIZE - conn->req.len;
+    return conn->recv_len >= RECV_BUF_SIZE;
+}
+
+static void handle_read(struct connection *conn) {
+    if (conn->fd == -1)
+        return;
+
+    if (!acquire_buffers(conn)) {
+        close_connection(conn);
+        return;
+    }
+
+    /* всё, что клиент имеет прислать */
+    ssize_t n = recv(conn->fd, conn->recv_buf + conn->recv_len,
+                     RECV_BUF_SIZE - conn->recv_len, 0);
+    /* если ни чего нет или клиент отвалился */
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            close_connection(conn);
+        return;
+    }
+    conn->recv_len += n;
+
+    /* срок на заголовки отсчитывается от первого байта запроса и не
+     * продлевается, чтобы медленный клиент не держал соединение */
+    if (conn->idle) {
+        conn->idle = false;
+        conn->start_us = stats_now_us();
+        set_timeout(conn, HEADER_TIMEOUT_MS);
+    }
+
+    /* разбор продолжается с места, где остановился прошлый раз */
+    switch (http_parse(&conn->req, conn->recv_buf, conn->recv_len)) {
+        case HTTP_PARSE_COMPLETE:
+            del_kqueue_event(conn->worker, conn->fd, EVFILT_READ);
+            handle_request(conn);
+            break;
+        case HTTP_PARSE_ERROR:
+            del_kqueue_event(conn->worker, conn->fd, EVFILT_READ);
+            send_error(conn, STATUS_BAD_REQUEST);
+            break;
+        case HTTP_PARSE_INCOMPLETE:
+            if (request_too_large(conn)) {
+                del_kqueue_event(conn->worker, conn->fd, EVFILT_READ);
+                send_error(conn, STATUS_PAYLOAD_TOO_LARGE);
+            }
+            break;
+    }
+    if (conn->fd != -1 && conn->state != STATE_READING)
+        set_timeout(conn, SEND_TIMEOUT_MS);
+}
+
+/**
+ * Запись о запросе в кольцо лога воркера. При переполнении запись
+ * теряется и учитывается в счётчике
+ * @param conn
+ */
+static void log_request(struct connection *conn) {
+    const struct http_request *req = &conn->req;
+    const char *buf = conn->recv_buf;
+    /* после ошибки разбора строки запроса может не быть */
+    size_t request_len = 0;
+    if (req->version.len > 0)
+        request_len = req->version.off + req->version.len - req->method.off;
+    if (!access_log_push(conn->worker->log, conn->peer, conn->status,
+        conn->content_len, buf + req->method.off, request_len,
+        buf + req->referer.off, req->referer.len,
+        buf + req->user_agent.off, req->user_agent.len))
+        stats_add(&conn->worker->stats.log_dropped, 1);
+}
+
+/**
+ * Завершение ответа. Для keep-alive соединение возвращается в
+ * STATE_READING, а уже пришедший следующий запрос (pipelining)
+ * обрабатывается сразу из recv_buf
+ * @param conn
+ */
+static void finish_response(struct connection *conn) {
+    const uint64_t now_us = stats_now_us();
+    stats_count_request(&conn->worker->stats, conn->status,
+        now_us - conn->start_us);
+    if (conn->worker->log)
+        log_request(conn);
+
+    if (!conn->keep_alive) {
+        close_connection(conn);
+        return;
+    }
+
+    if (conn->file) {
+        file_cache_release(&conn->worker->cache, conn->file);
+        conn->file = NULL;
+    }
+    conn->file_fd = -1;
+    free(conn->body);
+    conn->body = NULL;
+    conn->shared_body = NULL;
+    conn->file_offset = 0;
+    conn->file_end = 0;
+    conn->send_len = 0;
+    conn->send_sent = 0;
+    /* следующий запрос из буфера считается пришедшим сейчас */
+    conn->start_us = now_us;
+
+    /* сдвиг необработанного хвоста к началу буфера */
+    conn->recv_len -= conn->req.len;
+    memmove(conn->recv_buf, conn->recv_buf + conn->req.len, conn->recv_len);
+    http_request_reset(&conn->req);
+    conn->state = STATE_READING;
+
+    if (conn->recv_len > 0) {
+        switch (http_parse(&conn->req, conn->recv_buf, conn->recv_len)) {
+            case HTTP_PARSE_COMPLETE:
+                handle_request(conn);
+                if (conn->fd != -1)
+                    set_timeout(conn, SEND_TIMEOUT_MS);
+                return;
+            case HTTP_PARSE_ERROR:
+                send_error(conn, STATUS_BAD_REQUEST);
+                if (conn->fd != -1)
+                    set_timeout(conn, SEND_TIMEOUT_MS);
+                return;
+            case HTTP_PARSE_INCOMPLETE:
+                if (request_too_large(conn)) {
+                    send_error(conn, STATUS_PAYLOAD_TOO_LARGE);
+                    if (conn->fd != -1)
+                        set_timeout(conn, SEND_TIMEOUT_MS);
+                    return;
+                }
+                break;
+        }
     }
-    conn->fd = -1;
-    conn->state = STATE_CLOSING;
-    /* server.nconns уменьшится в основном цикле */
-}
 
-static const char *get_mime_type(const char *path) {
-    const char *ext = strrchr(path, '.');
-    if (!ext) return "application/octet-stream";
-    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)
-        return "text/html";
-    if (strcmp(ext, ".txt") == 0) return "text/plain";
-    if (strcmp(ext, ".css") == 0) return "text/css";
-    if (strcmp(ext, ".js") == 0) return "application/javascript";
-    if (strcmp(ext, ".json") == 0) return "application/json";
-    if (strcmp(ext, ".png") == 0) return "image/png";
-    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
-        return "image/jpeg";
-    if (strcmp(ext, ".gif") == 0) return "image/gif";
-    if (strcmp(ext, ".ico") == 0) return "image/x-icon";
-    if (strcmp(ext, ".svg") == 0) return "image/svg+xml";
-    if (strcmp(ext, ".pdf") == 0) return "application/pdf";
-    return "application/octet-stream";
-}
-
-static void url_decode(char *dst, const char *src, size_t dst_size) {
-    char *d = dst;
-    const char *ptr = src;
-    while (*ptr && d - dst < (ptrdiff_t)dst_size - 1) {
-        if (*ptr == '%' && ptr[1] != '\0' && ptr[2] != '\0') {
-            char hex[3] = {0};
-            strlcpy(hex, ptr + 1, sizeof(hex));
-            char *end = NULL;
-            errno = 0;
-            long val = strtol(hex, &end, 16);
-            if (errno == 0 && end == hex + 2 && val >= 0 && val <= 255) {
-                *d = (char)val;
-                d++;
-                ptr += 3;
-                continue;
-            }
-        } else if (*ptr == '+') {
-            *d = ' ';
-            d++;
-            ptr++;
-            continue;
-        }
-        *d = *ptr;
-        d++;
-        ptr++;
+    /* простаивающему соединению буферы не нужны */
+    if (conn->recv_len == 0) {
+        release_buffers(conn);
+        conn->idle = true;
+        set_timeout(conn, IDLE_TIMEOUT_MS);
+    } else {
+        set_timeout(conn, HEADER_TIMEOUT_MS);
     }
-    *d = '\0';
-}
 
-static bool is_safe_path(const char *path) {
-    if (strstr(path, "..") != NULL) return false;
-    return true;
+    del_kqueue_event(conn->worker, conn->fd, EVFILT_WRITE);
+    if (add_kqueue_event(conn->worker, conn->fd, EVFILT_READ, conn) == -1)
+        close_connection(conn);
 }
 
-static void build_http_status(struct connection *conn, int code,
-    const char *status, const char *content_type, size_t content_len) {
-    conn->send_len = (size_t)snprintf(conn->send_buf, sizeof(conn->send_buf),
-        "HTTP/1.1 %d %s\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %zu\r\n"
-        "Connection: close\r\n"
-        "\r\n",
-        code, status, content_type, content_len);
+/**
+ * Завершение тела из файла. Если за ним следует хвост, он отправляется
+ * как остаток заголовка, и ответ завершается уже после него
+ * @param conn
+ */
+static void finish_file_body(struct connection *conn) {
+    if (conn->trailer_len == 0) {
+        finish_response(conn);
+        return;
+    }
+    memcpy(conn->send_buf, conn->trailer, conn->trailer_len);
+    conn->send_len = conn->trailer_len;
     conn->send_sent = 0;
+    conn->trailer_len = 0;
     conn->state = STATE_SENDING_HEADER;
 }
 
-static void send_error(struct connection *conn, int code, const char *status) {
-    const char *body = status;
-    size_t body_len = strlen(body);
-    build_http_status(conn, code, status, "text/plain", body_len);
-
-    if (conn->send_len + body_len < sizeof(conn->send_buf)) {
-        memcpy(conn->send_buf + conn->send_len, body, body_len);
-        conn->send_len += body_len;
-    }
-    if (mod_kqueue_event(conn->fd, EVFILT_WRITE, conn) == -1) {
-        /* Не удалось зарегистрировать событие — закрываем соединение */
-        close_connection(conn);
+/**
+ * Передача блока файла из file_fd в сокет средствами ядра. Неотправленная
+ * часть заголовка уходит тем же вызовом (sf_hdtr в macOS и FreeBSD) или
+ * с MSG_MORE (Linux), так что заголовок и начало файла ложатся в один
+ * сегмент
+ * @param conn
+ * @param len число байт файла
+ * @return число переданных байт заголовка и файла или -1 (причина в errno)
+ */
+static ssize_t sendfile_chunk(struct connection *conn, size_t len) {
+    const size_t header_left = conn->send_len - conn->send_sent;
+#if defined(__APPLE__) || defined(__FreeBSD__)
+    struct iovec header = {
+        .iov_base = conn->send_buf + conn->send_sent,
+        .iov_len = header_left
+    };
+    struct sf_hdtr hdtr = { .headers = &header, .hdr_cnt = 1 };
+    struct sf_hdtr *hdtrp = header_left > 0 ? &hdtr : NULL;
+#endif
+#if defined(__APPLE__)
+    /* в macOS заголовок входит в len */
+    off_t sbytes = (off_t)(len + header_left);
+    if (sendfile(conn->file_fd, conn->fd, conn->file_offset, &sbytes,
+        hdtrp, 0) == -1 && sbytes == 0)
+        return -1;
+    return sbytes;
+#elif defined(__FreeBSD__)
+    off_t sbytes = 0;
+    if (sendfile(conn->file_fd, conn->fd, conn->file_offset, len,
+        hdtrp, &sbytes, 0) == -1 && sbytes == 0)
+        return -1;
+    return sbytes;
+#elif defined(__linux__)
+    ssize_t sent = 0;
+    if (header_left > 0) {
+        sent = send(conn->fd, conn->send_buf + conn->send_sent, header_left,
+            MSG_MORE);
+        if (sent < (ssize_t)header_left)
+            return sent;
     }
+    off_t offset = conn->file_offset;
+    ssize_t n = sendfile(conn->fd, conn->file_fd, &offset, len);
+    if (n < 0)
+        /* ошибка повторится при следующем вызове уже без заголовка */
+        return sent > 0 ? sent : -1;
+    return sent + n;
+#else
+    (void)conn;
+    (void)len;
+    (void)header_left;
+    errno = ENOSYS;
+    return -1;
+#endif
 }
 
-static void handle_request(struct connection *conn) {
-    char method[16], path[1024], version[16];
-    memset(method, 0, sizeof(method));
-    memset(path, 0, sizeof(path));
-    memset(version, 0, sizeof(version));
-    if (sscanf(conn->recv_buf, "%15s %1023s %15s",
-        method, path, version) != 3) {
-        send_error(conn, 400, "Bad Request");
-        return;
+/**
+ * Отправка файла через буфер соединения: pread в send_buf и send.
+ * Запасной вариант для систем и файлов, где sendfile недоступен.
+ * Пока буфер не начал уходить, блок файла дописывается за его содержимым,
+ * так что заголовок и начало файла отправляются одним send
+ * @param conn
+ */
+static void send_file_copy(struct connection *conn) {
+    if (conn->send_sent == conn->send_len) {
+        conn->send_len = 0;
+        conn->send_sent = 0;
     }
-    if (strcmp(method, "GET") != 0) {
-        send_error(conn, 405, "Method Not Allowed");
-        return;
+    if (conn->send_sent == 0 && conn->send_len < SEND_BUF_SIZE &&
+        (size_t)conn->file_offset < conn->file_end) {
+        size_t chunk = conn->file_end - conn->file_offset;
+        if (chunk > SEND_BUF_SIZE - conn->send_len)
+            chunk = SEND_BUF_SIZE - conn->send_len;
+        ssize_t nr = pread(conn->file_fd, conn->send_buf + conn->send_len,
+            chunk, conn->file_offset);
+        if (nr < 0) {
+            perror("pread");
+            close_connection(conn);
+            return;
+        }
+        if (nr == 0) {
+            /* файл укоротился во время отправки */
+            close_connection(conn);
+            return;
+        }
+        conn->send_len += nr;
+        conn->file_offset += nr;
     }
 
-    char decoded_path[1024];
-    memset(decoded_path, 0, sizeof(decoded_path));
-    url_decode(decoded_path, path, sizeof(decoded_path));
-
-    if (!is_safe_path(decoded_path)) {
-        send_error(conn, 403, "Forbidden");
+    if (conn->send_len == 0) {
+        finish_file_body(conn);
         return;
     }
 
-    char full_path[PATH_MAX];
-    memset(full_path, 0, sizeof(full_path));
-    int written = snprintf(full_path, sizeof(full_path), "%s/%s",
-        server.root_dir, decoded_path);
-    if (written < 0 || (size_t)written >= sizeof(full_path)) {
-        send_error(conn, 414, "URI Too Long");
+    ssize_t sent = send(conn->fd, conn->send_buf + conn->send_sent,
+                        conn->send_len - conn->send_sent, 0);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        if (errno != EPIPE && errno != ECONNRESET)
+            perror("send file chunk");
+        close_connection(conn);
         return;
     }
+    conn->send_sent += sent;
+    stats_add(&conn->worker->stats.bytes_sent, (uint64_t)sent);
+    if (conn->send_sent == conn->send_len &&
+        (size_t)conn->file_offset >= conn->file_end)
+        finish_file_body(conn);
+}
 
-    struct stat st = {0};
-    if (stat(full_path, &st) == -1) {
-        if (errno == ENOENT)
-            send_error(conn, 404, "Not Found");
-        else if (errno == EACCES)
-            send_error(conn, 403, "Forbidden");
-        else
-            send_error(conn, 500, "Internal Server Error");
+/**
+ * Отправка файла без копирования через sendfile. Если ядро не умеет
+ * sendfile для этого файла или сокета, соединение переключается на
+ * send_file_copy с текущего смещения
+ * @param conn
+ */
+static void send_file_zero_copy(struct connection *conn) {
+    const size_t header_left = conn->send_len - conn->send_sent;
+    if (header_left == 0 && (size_t)conn->file_offset >= conn->file_end) {
+        finish_file_body(conn);
         return;
     }
 
-    if (!S_ISREG(st.st_mode)) {
-        send_error(conn, 404, "Not Found");
-        return;
-    }
+    size_t len = conn->file_end - conn->file_offset;
+    if (len > SENDFILE_CHUNK)
+        len = SENDFILE_CHUNK;
 
-    if (access(full_path, R_OK) == -1) {
-        send_error(conn, 403, "Forbidden");
+    ssize_t sent = sendfile_chunk(conn, len);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        if (errno == ENOSYS || errno == EINVAL || errno == ENOTSOCK ||
+            errno == ENOTSUP || errno == EOPNOTSUPP) {
+            conn->use_sendfile = false;
+            send_file_copy(conn);
+            return;
+        }
+        if (errno != EPIPE && errno != ECONNRESET)
+            perror("sendfile");
+        close_connection(conn);
         return;
     }
-
-    int file_fd = open(full_path, O_RDONLY);
-    if (file_fd == -1) {
-        send_error(conn, 500, "Internal Server Error");
+    if (sent == 0) {
+        /* файл укоротился во время отправки */
+        close_connection(conn);
         return;
     }
 
-    conn->file_fd = file_fd;
-    conn->file_offset = 0;
-    conn->file_size = st.st_size;
-    build_http_status(conn, 200, "OK", get_mime_type(full_path),
-        st.st_size);
-    if (mod_kqueue_event(conn->fd, EVFILT_WRITE, conn) == -1) {
-        close_connection(conn);
-    }
+    size_t n = (size_t)sent;
+    stats_add(&conn->worker->stats.bytes_sent, n);
+    const size_t from_header = n < header_left ? n : header_left;
+    conn->send_sent += from_header;
+    conn->file_offset += (off_t)(n - from_header);
+    if (conn->send_sent == conn->send_len &&
+        (size_t)conn->file_offset >= conn->file_end)
+        finish_file_body(conn);
 }
 
-static void handle_read(struct connection *conn) {
-    if (conn->fd == -1)
+/**
+ * Отправка ответа из памяти (файл из кэша или сформированное тело
+ * body): остаток заголовка и тела уходит одним writev без обращений к
+ * файлу
+ * @param conn
+ */
+static void send_from_memory(struct connection *conn) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    const size_t header_left = conn->send_len - conn->send_sent;
+    if (header_left > 0) {
+        iov[iovcnt].iov_base = conn->send_buf + conn->send_sent;
+        iov[iovcnt].iov_len = header_left;
+        iovcnt++;
+    }
+    if ((size_t)conn->file_offset < conn->file_end) {
+        const char *data = conn->body ? conn->body :
+            conn->shared_body ? conn->shared_body : conn->file->data;
+        iov[iovcnt].iov_base = (char *)data + conn->file_offset;
+        iov[iovcnt].iov_len = conn->file_end - conn->file_offset;
+        iovcnt++;
+    }
+    if (iovcnt == 0) {
+        finish_response(conn);
         return;
+    }
 
-    /* всё, что клиент имеет прислать */
-    ssize_t n = recv(conn->fd, conn->recv_buf + conn->recv_len,
-                     sizeof(conn->recv_buf) - conn->recv_len - 1, 0);
-    /* если ни чего нет или клиент отвалился */
-    if (n <= 0) {
-        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
-            close_connection(conn);
+    ssize_t sent = writev(conn->fd, iov, iovcnt);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        if (errno != EPIPE && errno != ECONNRESET)
+            perror("writev");
+        close_connection(conn);
         return;
     }
-    conn->recv_len += n;
-    conn->recv_buf[conn->recv_len] = '\0';
 
-    if (strstr(conn->recv_buf, "\r\n\r\n") != NULL) {
-        del_kqueue_event(conn->fd, EVFILT_READ);
-        handle_request(conn);
-    } else if (conn->recv_len >= sizeof(conn->recv_buf) - 1) {
-        send_error(conn, 413, "Payload Too Large");
-    }
+    size_t n = (size_t)sent;
+    stats_add(&conn->worker->stats.bytes_sent, n);
+    const size_t from_header = n < header_left ? n : header_left;
+    conn->send_sent += from_header;
+    conn->file_offset += (off_t)(n - from_header);
+    if (conn->send_sent == conn->send_len &&
+        (size_t)conn->file_offset >= conn->file_end)
+        finish_response(conn);
 }
 
 static void handle_write(struct connection *conn) {
     if (conn->fd == -1)
         return;
 
+    /* событие записи приходит только при свободном месте в буфере сокета,
+     * то есть клиент принимает данные */
+    set_timeout(conn, SEND_TIMEOUT_MS);
+
+    if (conn->body || conn->shared_body ||
+        (conn->file && conn->file->in_memory)) {
+        send_from_memory(conn);
+        return;
+    }
+
+    /* заголовок ответа с телом уходит вместе с началом файла */
+    if (conn->state == STATE_SENDING_HEADER && conn->file_fd != -1 &&
+        (size_t)conn->file_offset < conn->file_end)
+        conn->state = STATE_SENDING_FILE;
+
     if (conn->state == STATE_SENDING_HEADER) {
         ssize_t sent = send(conn->fd, conn->send_buf + conn->send_sent,
                             conn->send_len - conn->send_sent, 0);
@@ -325,107 +1693,145 @@ static void handle_write(struct connection *conn) {
             return;
         }
         conn->send_sent += sent;
+        stats_add(&conn->worker->stats.bytes_sent, (uint64_t)sent);
         if (conn->send_sent < conn->send_len)
             return;
-
-        if (conn->file_fd != -1) {
-            conn->state = STATE_SENDING_FILE;
-            conn->send_len = 0;
-            conn->send_sent = 0;
-        } else {
-            close_connection(conn);
-            return;
-        }
+        finish_response(conn);
+        return;
     }
 
     if (conn->state == STATE_SENDING_FILE) {
-        if (conn->send_sent < conn->send_len) {
-            ssize_t sent = send(conn->fd, conn->send_buf + conn->send_sent,
-                                conn->send_len - conn->send_sent, 0);
-            if (sent < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    return;
-                if (errno != EPIPE && errno != ECONNRESET)
-                    perror("send file chunk");
-                close_connection(conn);
-                return;
-            }
-            conn->send_sent += sent;
-            if (conn->send_sent < conn->send_len)
-                return;
-        }
+        if (conn->use_sendfile)
+            send_file_zero_copy(conn);
+        else
+            send_file_copy(conn);
+    }
+}
 
-        /* следующий блок файла */
-        char buf[SEND_BUF_SIZE];
-        ssize_t nr = pread(conn->file_fd, buf, sizeof(buf),
-            conn->file_offset);
-        if (nr < 0) {
-            perror("pread");
-            close_connection(conn);
-            return;
-        }
-        if (nr == 0) {
-            /* Конец файла */
-            close_connection(conn);
-            return;
-        }
+/**
+ * Пауза приёма: пока воркер на пределе соединений, новые подключения
+ * ждут в очереди listen ядра, а не принимаются и сразу закрываются
+ * @param w
+ */
+static void pause_accept(struct worker *w) {
+    if (w->accept_paused)
+        return;
+    if (toggle_kqueue_event(w, w->listen_fd, EVFILT_READ, false) == 0) {
+        w->accept_paused = true;
+        stats_add(&w->stats.accept_pauses, 1);
+    }
+}
 
-        memcpy(conn->send_buf, buf, nr);
-        conn->send_len = nr;
-        conn->send_sent = 0;
-        conn->file_offset += nr;
+static void resume_accept(struct worker *w) {
+    if (!w->accept_paused)
+        return;
+    if (toggle_kqueue_event(w, w->listen_fd, EVFILT_READ, true) == 0)
+        w->accept_paused = false;
+}
 
-        ssize_t sent = send(conn->fd, conn->send_buf, conn->send_len, 0);
-        if (sent < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                return;
-            if (errno != EPIPE && errno != ECONNRESET)
-                perror("send file chunk");
-            close_connection(conn);
-            return;
-        }
-        conn->send_sent = sent;
+/**
+ * Приём одного подключения
+ * @param w
+ * @return false, если очередь пуста или приём приостановлен
+ */
+static bool accept_connection(struct worker *w) {
+    if (w->nconns >= server.max_conns) {
+        pause_accept(w);
+        return false;
     }
-}
 
-static void accept_connection(void) {
     struct sockaddr_in addr = {0};
     socklen_t addrlen = sizeof(addr);
-    int client_fd = accept(server.listen_fd, (struct sockaddr *)&addr,
+#ifdef SOCK_NONBLOCK
+    /* неблокирующий режим сразу, без отдельного fcntl */
+    int client_fd = accept4(w->listen_fd, (struct sockaddr *)&addr,
+        &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int client_fd = accept(w->listen_fd, (struct sockaddr *)&addr,
         &addrlen);
+#endif
     if (client_fd == -1) {
+        if (errno == ECONNABORTED || errno == EINTR)
+            return true;
+        if ((errno == EMFILE || errno == ENFILE) && w->nconns > 0) {
+            /* дескрипторы освободятся с закрытием соединений */
+            stats_add(&w->stats.accept_rejects, 1);
+            pause_accept(w);
+            return false;
+        }
         if (errno != EAGAIN && errno != EWOULDBLOCK)
             perror("accept");
-        return;
-    }
-
-    if (server.nconns >= MAX_CONN) {
-        close(client_fd);
-        return;
+        return false;
     }
 
+#ifndef SOCK_NONBLOCK
     /* неблокирующий режим на клиенте */
     if (set_nonblocking(client_fd) == -1) {
         close(client_fd);
-        return;
+        stats_add(&w->stats.accept_rejects, 1);
+        return true;
     }
+#endif
+    /* ответ всегда пишется целиком (writev, sf_hdtr, MSG_MORE), поэтому
+     * Nagle только задержал бы последний неполный сегмент */
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-    struct connection *conn = &server.conns[server.nconns];
-    server.nconns++;
+    struct connection *conn = alloc_connection(w);
+    if (!conn) {
+        close(client_fd);
+        stats_add(&w->stats.accept_rejects, 1);
+        return true;
+    }
     memset(conn, 0, sizeof(*conn));
+    http_request_reset(&conn->req);
+    conn->worker = w;
     conn->fd = client_fd;
     conn->state = STATE_READING;
     conn->file_fd = -1;
+    conn->use_sendfile = true;
+    conn->start_us = stats_now_us();
+    conn->peer = addr.sin_addr.s_addr;
 
-    if (add_kqueue_event(client_fd, EVFILT_READ, conn) == -1) {
+    if (add_kqueue_event(w, client_fd, EVFILT_READ, conn) == -1) {
         close(client_fd);
-        server.nconns--;
+        conn->fd = -1;
+        release_connection(w, conn);
+        stats_add(&w->stats.accept_rejects, 1);
+        return true;
+    }
+    stats_add(&w->stats.accepts, 1);
+    set_timeout(conn, HEADER_TIMEOUT_MS);
+    return true;
+}
+
+/**
+ * Приём накопившихся подключений за одно пробуждение, не больше
+ * ACCEPT_BATCH, чтобы не задерживать события уже открытых соединений
+ * @param w
+ */
+static void accept_connections(struct worker *w) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        if (!accept_connection(w))
+            break;
     }
 }
 
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Использование: %s -d <директория> и/или"
+                    " -z <архив сайта>"
+                    " -l <адрес:порт> [-w <число воркеров>] [-p]"
+                    " [-s <байт>] [-c <соединений>] [-a <лог доступа>]"
+                    " [-e batch|direct] [-m <mime.types>]\n", prog);
+}
+
 static int parse_args(int argc, char *argv[]) {
     int opt;
-    while ((opt = getopt(argc, argv, "d:l:")) != -1) {
+    server.nworkers = 1;
+    server.small_file = FILE_CACHE_SMALL_FILE;
+    server.max_conns = MAX_CONN;
+    server.batch_changes = true;
+    while ((opt = getopt(argc, argv, "d:l:w:ps:c:a:e:z:m:")) != -1) {
         switch (opt) {
             case 'd':
                 server.root_dir = optarg;
@@ -433,13 +1839,69 @@ static int parse_args(int argc, char *argv[]) {
             case 'l':
                 server.listen_addr = optarg;
                 break;
+            case 'w': {
+                char *end;
+                errno = 0;
+                long val = strtol(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || val <= 0 ||
+                    val > MAX_WORKERS) {
+                    fprintf(stderr, "Неверное число воркеров '%s'\n", optarg);
+                    goto error;
+                }
+                server.nworkers = (int)val;
+                break;
+            }
+            case 'p':
+                server.pin_cpus = true;
+                break;
+            case 's': {
+                char *end;
+                errno = 0;
+                long long val = strtoll(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || val < 0) {
+                    fprintf(stderr, "Неверный размер файла '%s'\n", optarg);
+                    goto error;
+                }
+                server.small_file = (size_t)val;
+                break;
+            }
+            case 'c': {
+                char *end;
+                errno = 0;
+                long val = strtol(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || val <= 0) {
+                    fprintf(stderr, "Неверное число соединений '%s'\n",
+                        optarg);
+                    goto error;
+                }
+                server.max_conns = (size_t)val;
+                break;
+            }
+            case 'a':
+                server.access_log_path = optarg;
+                break;
+            case 'z':
+                server.archive_path = optarg;
+                break;
+            case 'm':
+                server.mime_path = optarg;
+                break;
+            case 'e':
+                if (strcmp(optarg, "batch") == 0) {
+                    server.batch_changes = true;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    server.batch_changes = false;
+                } else {
+                    fprintf(stderr, "Неверный режим событий '%s'\n", optarg);
+                    goto error;
+                }
+                break;
             default:
-                fprintf(stderr, "Использование: %s -d <директория>"
-                                " -l <адрес:порт>\n", argv[0]);
+                print_usage(argv[0]);
                 goto error;
         }
     }
-    if (!server.root_dir || !server.listen_addr) {
+    if ((!server.root_dir && !server.archive_path) || !server.listen_addr) {
         fprintf(stderr, "Отсутствуют необходимые аргументы\n");
         goto error;
     }
@@ -448,14 +1910,18 @@ error:
     return -1;
 }
 
-static int setup_listen_socket(void) {
+/**
+ * Разбор адреса вида адрес:порт в server.addr
+ * @return
+ */
+static int parse_listen_addr(void) {
     char addr_str[64] = {0};
     strlcpy(addr_str, server.listen_addr, sizeof(addr_str));
 
     char *colon = strrchr(addr_str, ':');
     if (!colon) {
         fprintf(stderr, "Неверный формат адреса. Ожидается адрес:порт\n");
-        goto error;
+        return -1;
     }
     *colon = '\0';
     const char* port_str = colon + 1;
@@ -464,93 +1930,169 @@ static int setup_listen_socket(void) {
     long port = strtol(port_str, &end, 10);
     if (*end != '\0' || port <= 0 || port > 65535) {
         fprintf(stderr, "Неверный порт\n");
-        goto error;
+        return -1;
+    }
+
+    server.addr.sin_family = AF_INET;
+    server.addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, addr_str, &server.addr.sin_addr) != 1) {
+        fprintf(stderr, "Неверный адрес\n");
+        return -1;
     }
+    return 0;
+}
 
+/**
+ * Создание слушающего сокета воркера. При LISTEN_REUSEPORT у каждого
+ * воркера свой сокет на одном и том же адресе
+ * @param w
+ * @return
+ */
+static int setup_listen_socket(struct worker *w) {
     /* Создание сокета сервера */
-    server.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server.listen_fd == -1)
+    w->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (w->listen_fd == -1)
         goto error;
 
     int optval = 1;
-    if (setsockopt(server.listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval,
+    if (setsockopt(w->listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval,
         sizeof(optval)) == -1)
         goto error;
-
-    struct sockaddr_in sa = {0};
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons((uint16_t)port);
-    if (inet_pton(AF_INET, addr_str, &sa.sin_addr) != 1)
+#ifdef LISTEN_REUSEPORT
+    if (setsockopt(w->listen_fd, SOL_SOCKET, LISTEN_REUSEPORT, &optval,
+        sizeof(optval)) == -1)
         goto error;
+#endif
 
-    if (bind(server.listen_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+    if (bind(w->listen_fd, (struct sockaddr *)&server.addr,
+        sizeof(server.addr)) == -1)
         goto error;
-    if (listen(server.listen_fd, SOMAXCONN) == -1)
+    if (listen(w->listen_fd, SOMAXCONN) == -1)
         goto error;
 
-    if (set_nonblocking(server.listen_fd) == -1)
+    if (set_nonblocking(w->listen_fd) == -1)
         goto error;
 
     return 0;
 
     error:
-        if (server.listen_fd != -1) {
-            close(server.listen_fd);
-            server.listen_fd = -1;
+        if (w->listen_fd != -1) {
+            close(w->listen_fd);
+            w->listen_fd = -1;
         }
     return -1;
 }
 
-void free_conns(void) {
-    size_t j = 0;
-    for (size_t i = 0; i < server.nconns; i++) {
-        if (server.conns[i].fd != -1) {
-            if (i != j)
-                server.conns[j] = server.conns[i];
-            j++;
-        }
+/**
+ * Возврат закрытых за пачку событий соединений в свободный список и
+ * снятие паузы приёма
+ * @param w
+ */
+static void free_conns(struct worker *w) {
+    const bool freed = w->closed_conns != NULL;
+    while (w->closed_conns) {
+        struct connection *conn = w->closed_conns;
+        w->closed_conns = conn->next_free;
+        release_connection(w, conn);
     }
-    server.nconns = j;
+    /* освободились места — подключения из очереди ядра снова
+     * принимаются */
+    if (freed && w->nconns < server.max_conns)
+        resume_accept(w);
 }
 
-int main(int argc, char *argv[]) {
-    signal(SIGPIPE, SIG_IGN);
-    atexit(cleanup);
-
-    server.kq = -1;
-    server.listen_fd = -1;
-    for (size_t i = 0; i < MAX_CONN; i++) {
-        server.conns[i].fd = -1;
-        server.conns[i].file_fd = -1;
-    }
-
-    if (parse_args(argc, argv) == -1)
-        exit(EXIT_FAILURE);
+/**
+ * Закрытие соединения, чей срок истёк
+ * @param t
+ * @param arg
+ */
+static void expire_connection(struct timer *t, void *arg) {
+    (void)arg;
+    struct connection *conn = (struct connection *)
+        ((char *)t - offsetof(struct connection, timer));
+    close_connection(conn);
+}
 
-    if (setup_listen_socket() == -1)
-        die("setup_listen_socket");
+/**
+ * Привязка текущего потока к ядру процессора. В macOS доступна только
+ * подсказка планировщику через affinity tag
+ * @param cpu
+ */
+static void pin_to_cpu(int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (errno != 0)
+        perror("pthread_setaffinity_np");
+#elif defined(__FreeBSD__)
+    cpuset_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (errno != 0)
+        perror("pthread_setaffinity_np");
+#elif defined(__APPLE__)
+    thread_affinity_policy_data_t policy = { cpu + 1 };
+    if (thread_policy_set(pthread_mach_thread_np(pthread_self()),
+        THREAD_AFFINITY_POLICY, (thread_policy_t)&policy,
+        THREAD_AFFINITY_POLICY_COUNT) != KERN_SUCCESS)
+        fprintf(stderr, "thread_policy_set: не удалось задать affinity\n");
+#else
+    (void)cpu;
+#endif
+}
 
-    server.kq = kqueue();
-    if (server.kq == -1)
-        die("kqueue");
+/**
+ * Цикл событий воркера
+ * @param arg
+ * @return
+ */
+static void *worker_loop(void *arg) {
+    struct worker *w = arg;
 
-    if (add_kqueue_event(server.listen_fd, EVFILT_READ, NULL) == -1)
-        die("add_kqueue_event");
+    if (server.pin_cpus) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        pin_to_cpu(ncpu > 0 ? w->id % (int)ncpu : 0);
+    }
 
-    struct kevent events[MAX_KEVENTS] = {0};
+    /* каждое неудачное изменение пачки занимает в ответе запись EV_ERROR.
+     * Если им не хватит места, kevent вернёт -1 и бросит остаток пачки,
+     * поэтому массив рассчитан на MAX_KEVENTS событий плюс ошибку на
+     * каждое изменение */
+    struct kevent events[MAX_KEVENTS + MAX_CHANGES] = {0};
+    w->now = timer_now_ms();
+    timer_wheel_init(&w->timers, w->now);
     while (true) {
+        /* ожидание ограничено следующим тиком колеса таймеров */
+        struct timespec ts;
+        struct timespec *timeout = NULL;
+        int ms = timer_wheel_timeout(&w->timers, w->now);
+        if (ms >= 0) {
+            ts.tv_sec = ms / 1000;
+            ts.tv_nsec = (long)(ms % 1000) * 1000000;
+            timeout = &ts;
+        }
+
         /* ожидание и обработка готовых событий */
-        int nev = kevent(server.kq, NULL, 0, events,
-            MAX_KEVENTS, NULL);
+        int nev = kevent(w->kq, w->changes, w->nchanges, events,
+            MAX_KEVENTS + w->nchanges, timeout);
+        w->nchanges = 0;
         if (nev == -1) {
             if (errno == EINTR) continue;
             die("kevent");
         }
+        w->now = timer_now_ms();
 
         for (int i = 0; i < nev; i++) {
             struct kevent *ev = &events[i];
-            if (ev->ident == (uintptr_t)server.listen_fd) {
-                accept_connection(); /* регистрация новых событий */
+            if (ev->flags & EV_ERROR) {
+                handle_change_error(w, ev);
+            } else if (ev->filter == EVFILT_VNODE) {
+                file_cache_invalidate(&w->cache, ev->udata);
+            } else if (ev->ident == (uintptr_t)w->listen_fd) {
+                accept_connections(w); /* регистрация новых событий */
             } else {
                 struct connection *conn = ev->udata;
                 if (conn == NULL) continue;
@@ -562,9 +2104,117 @@ int main(int argc, char *argv[]) {
             }
         }
 
-        /* удаление закрытых соединений */
-        free_conns();
+        /* закрытие соединений с истёкшим сроком */
+        timer_wheel_expire(&w->timers, w->now, expire_connection, NULL);
+
+        /* удаление закрытых соединений и исключённых из кэша файлов */
+        free_conns(w);
+        file_cache_collect(&w->cache);
+    }
+
+    return NULL;
+}
+
+/**
+ * Поднятие мягкого предела открытых файлов под число соединений
+ */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        return;
+    rlim_t want = (rlim_t)server.max_conns * (rlim_t)server.nworkers +
+        FILE_CACHE_MAX_FILES * (rlim_t)server.nworkers + 64;
+    if (rl.rlim_max != RLIM_INFINITY && want > rl.rlim_max)
+        want = rl.rlim_max;
+#ifdef OPEN_MAX
+    /* macOS не даёт поднять предел выше OPEN_MAX даже при RLIM_INFINITY */
+    if (want > OPEN_MAX)
+        want = OPEN_MAX;
+#endif
+    if (want <= rl.rlim_cur)
+        return;
+    rl.rlim_cur = want;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+        perror("setrlimit RLIMIT_NOFILE");
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    atexit(cleanup);
+
+    if (parse_args(argc, argv) == -1)
+        exit(EXIT_FAILURE);
+
+    if (parse_listen_addr() == -1)
+        exit(EXIT_FAILURE);
+
+    if (mime_map_init(&server.mime) == -1 ||
+        (server.mime_path && mime_map_load(&server.mime,
+        server.mime_path) == -1) || mime_map_build(&server.mime) == -1)
+        exit(EXIT_FAILURE);
+
+    if (server.archive_path && site_archive_open(&server.archive,
+        server.archive_path, get_mime_type) == -1)
+        exit(EXIT_FAILURE);
+
+    server.workers = calloc(server.nworkers, sizeof(struct worker));
+    if (!server.workers)
+        die("calloc workers");
+    for (int w = 0; w < server.nworkers; w++) {
+        struct worker *worker = &server.workers[w];
+        worker->id = w;
+        worker->kq = -1;
+        worker->listen_fd = -1;
+        buf_pool_init(&worker->recv_pool, RECV_BUF_SIZE, MAX_FREE_BUFS);
+        buf_pool_init(&worker->send_pool, SEND_BUF_SIZE, MAX_FREE_BUFS);
+    }
+    raise_fd_limit();
+
+    if (server.access_log_path) {
+        if (access_log_open(&server.access_log, server.access_log_path,
+            server.nworkers) == -1)
+            exit(EXIT_FAILURE);
+        for (int w = 0; w < server.nworkers; w++)
+            server.workers[w].log = &server.access_log.rings[w];
+        if (access_log_start(&server.access_log) == -1)
+            exit(EXIT_FAILURE);
+    }
+
+    for (int w = 0; w < server.nworkers; w++) {
+        struct worker *worker = &server.workers[w];
+#ifdef LISTEN_REUSEPORT
+        if (setup_listen_socket(worker) == -1)
+            die("setup_listen_socket");
+#else
+        if (w == 0) {
+            if (setup_listen_socket(worker) == -1)
+                die("setup_listen_socket");
+        } else {
+            worker->listen_fd = server.workers[0].listen_fd;
+        }
+#endif
+
+        worker->kq = kqueue();
+        if (worker->kq == -1)
+            die("kqueue");
+        file_cache_init(&worker->cache, worker->kq, FILE_CACHE_MAX_FILES,
+            server.small_file, FILE_CACHE_MAX_MEM);
+
+        if (add_kqueue_event(worker, worker->listen_fd, EVFILT_READ,
+            NULL) == -1 || flush_changes(worker) == -1)
+            die("add_kqueue_event");
+    }
+
+    atomic_store(&server.workers_running, true);
+    for (int w = 0; w < server.nworkers; w++) {
+        errno = pthread_create(&server.workers[w].thread, NULL, worker_loop,
+            &server.workers[w]);
+        if (errno != 0)
+            die("pthread_create");
     }
+    for (int w = 0; w < server.nworkers; w++)
+        pthread_join(server.workers[w].thread, NULL);
+    atomic_store(&server.workers_running, false);
 
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,366 @@
+#include "mime.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_DISPLACE (1u << 20)
+#define MAX_BUCKET 64 /* предел записей в корзине, в среднем их около одной */
+
+static const struct {
+    const char *type;
+    const char *exts;
+} builtin_types[] = {
+    { "text/html", "html htm" },
+    { "text/plain", "txt" },
+    { "text/css", "css" },
+    { "application/javascript", "js" },
+    { "application/json", "json" },
+    { "image/png", "png" },
+    { "image/jpeg", "jpg jpeg" },
+    { "image/gif", "gif" },
+    { "image/x-icon", "ico" },
+    { "image/svg+xml", "svg" },
+    { "application/pdf", "pdf" },
+};
+
+static uint64_t hash_ext(const char *ext, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)ext[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Второй хеш: перемешивание первого со смещением корзины
+ * @param h
+ * @param d
+ * @return
+ */
+static uint64_t displace_hash(uint64_t h, uint32_t d) {
+    h ^= (uint64_t)d * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Текстовые типы, для которых имеет смысл искать сжатые копии
+ * @param name
+ * @return
+ */
+static bool is_compressible(const char *name) {
+    return strncmp(name, "text/", 5) == 0 ||
+        strcmp(name, "application/javascript") == 0 ||
+        strcmp(name, "application/json") == 0 ||
+        strcmp(name, "image/svg+xml") == 0;
+}
+
+static const struct mime_type *intern_type(struct mime_map *map,
+    const char *name) {
+    for (size_t i = 0; i < map->ntypes; i++) {
+        if (strcmp(map->types[i]->name, name) == 0)
+            return map->types[i];
+    }
+    struct mime_type **types = realloc(map->types,
+        (map->ntypes + 1) * sizeof(*types));
+    if (!types)
+        return NULL;
+    map->types = types;
+    struct mime_type *t = malloc(sizeof(*t));
+    char *copy = strdup(name);
+    if (!t || !copy) {
+        free(t);
+        free(copy);
+        return NULL;
+    }
+    t->name = copy;
+    t->compressible = is_compressible(copy);
+    map->types[map->ntypes] = t;
+    map->ntypes++;
+    return t;
+}
+
+/**
+ * Добавление расширения (без точки) или замена его типа
+ * @param map
+ * @param ext
+ * @param type
+ * @return
+ */
+static int add_ext(struct mime_map *map, const char *ext,
+    const struct mime_type *type) {
+    if (*ext == '.')
+        ext++;
+    const size_t len = strlen(ext);
+    if (len == 0 || len >= MIME_MAX_EXT)
+        return 0;
+    char lower[MIME_MAX_EXT];
+    for (size_t i = 0; i < len; i++)
+        lower[i] = (char)tolower((unsigned char)ext[i]);
+
+    for (size_t i = 0; i < map->count; i++) {
+        struct mime_entry *e = &map->entries[i];
+        if (e->ext_len == len && memcmp(e->ext, lower, len) == 0) {
+            e->type = type;
+            return 0;
+        }
+    }
+    if (map->count == map->capacity) {
+        size_t capacity = map->capacity ? map->capacity * 2 : 32;
+        struct mime_entry *tmp = realloc(map->entries,
+            capacity * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        map->entries = tmp;
+        map->capacity = capacity;
+    }
+    struct mime_entry *e = &map->entries[map->count];
+    memcpy(e->ext, lower, len);
+    e->ext_len = len;
+    e->type = type;
+    map->count++;
+    return 0;
+}
+
+/**
+ * Разбор строки «тип расширение...». Строка портится
+ * @param map
+ * @param line
+ * @return
+ */
+static int add_line(struct mime_map *map, char *line) {
+    char *hash = strchr(line, '#');
+    if (hash)
+        *hash = '\0';
+    char *save = NULL;
+    const char *name = strtok_r(line, " \t\r\n", &save);
+    if (!name || !strchr(name, '/') || strlen(name) > MIME_MAX_TYPE)
+        return 0;
+    const struct mime_type *type = intern_type(map, name);
+    if (!type)
+        return -1;
+    const char *ext;
+    while ((ext = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        if (add_ext(map, ext, type) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int mime_map_init(struct mime_map *map) {
+    memset(map, 0, sizeof(*map));
+    map->fallback.name = MIME_DEFAULT_TYPE;
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]);
+        i++) {
+        char line[128];
+        snprintf(line, sizeof(line), "%s %s", builtin_types[i].type,
+            builtin_types[i].exts);
+        if (add_line(map, line) == -1) {
+            perror("mime_map_init");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int mime_map_load(struct mime_map *map, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_cap = 0;
+    int ret = 0;
+    while (getline(&line, &line_cap, f) != -1) {
+        if (add_line(map, line) == -1) {
+            perror(path);
+            ret = -1;
+            break;
+        }
+    }
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+struct bucket {
+    size_t index;
+    size_t size;
+};
+
+static int compare_buckets(const void *a, const void *b) {
+    const struct bucket *x = a;
+    const struct bucket *y = b;
+    if (x->size != y->size)
+        return x->size < y->size ? 1 : -1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Подбор смещений для всех корзин при заданном числе слотов. Корзины
+ * обрабатываются от больших к меньшим, пока свободных слотов много
+ * @param map
+ * @param hashes Первые хеши записей
+ * @param order Записи, сгруппированные по корзинам
+ * @param start Начало корзины в order
+ * @param buckets Корзины по убыванию размера
+ * @return false, если для какой-то корзины смещение не нашлось
+ */
+static bool place_buckets(struct mime_map *map, const uint64_t *hashes,
+    const size_t *order, const size_t *start, const struct bucket *buckets) {
+    const size_t nbuckets = map->bucket_mask + 1;
+    for (size_t i = 0; i <= map->slot_mask; i++)
+        map->slots[i] = -1;
+
+    size_t placed[MAX_BUCKET];
+    for (size_t b = 0; b < nbuckets && buckets[b].size > 0; b++) {
+        const size_t bi = buckets[b].index;
+        const size_t *keys = &order[start[bi]];
+        const size_t n = buckets[b].size;
+        if (n > MAX_BUCKET)
+            return false;
+        uint32_t d = 0;
+        for (; d < MAX_DISPLACE; d++) {
+            size_t k = 0;
+            for (; k < n; k++) {
+                const size_t slot = displace_hash(hashes[keys[k]], d) &
+                    map->slot_mask;
+                bool taken = map->slots[slot] != -1;
+                for (size_t j = 0; !taken && j < k; j++)
+                    taken = placed[j] == slot;
+                if (taken)
+                    break;
+                placed[k] = slot;
+            }
+            if (k == n)
+                break;
+        }
+        if (d == MAX_DISPLACE)
+            return false;
+        map->displace[bi] = d;
+        for (size_t k = 0; k < n; k++)
+            map->slots[placed[k]] = (int32_t)keys[k];
+    }
+    return true;
+}
+
+int mime_map_build(struct mime_map *map) {
+    free(map->displace);
+    free(map->slots);
+    map->displace = NULL;
+    map->slots = NULL;
+    if (map->count == 0)
+        return 0;
+
+    size_t nbuckets = 1;
+    while (nbuckets < map->count)
+        nbuckets *= 2;
+    size_t nslots = nbuckets * 2;
+    map->bucket_mask = nbuckets - 1;
+
+    uint64_t *hashes = malloc(map->count * sizeof(*hashes));
+    size_t *order = malloc(map->count * sizeof(*order));
+    size_t *start = calloc(nbuckets + 1, sizeof(*start));
+    struct bucket *buckets = calloc(nbuckets, sizeof(*buckets));
+    map->displace = calloc(nbuckets, sizeof(*map->displace));
+    int ret = -1;
+    if (!hashes || !order || !start || !buckets || !map->displace)
+        goto out;
+
+    /* группировка записей по корзинам подсчётом */
+    for (size_t i = 0; i < map->count; i++) {
+        hashes[i] = hash_ext(map->entries[i].ext, map->entries[i].ext_len);
+        start[(hashes[i] & map->bucket_mask) + 1]++;
+    }
+    for (size_t b = 0; b < nbuckets; b++) {
+        buckets[b].index = b;
+        buckets[b].size = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    size_t *fill = calloc(nbuckets, sizeof(*fill));
+    if (!fill)
+        goto out;
+    for (size_t i = 0; i < map->count; i++) {
+        const size_t b = hashes[i] & map->bucket_mask;
+        order[start[b] + fill[b]] = i;
+        fill[b]++;
+    }
+    free(fill);
+    qsort(buckets, nbuckets, sizeof(*buckets), compare_buckets);
+
+    /* при неудаче слотов становится вдвое больше */
+    for (int attempt = 0; attempt < 4; attempt++, nslots *= 2) {
+        free(map->slots);
+        map->slots = malloc(nslots * sizeof(*map->slots));
+        if (!map->slots)
+            goto out;
+        map->slot_mask = nslots - 1;
+        if (place_buckets(map, hashes, order, start, buckets)) {
+            ret = 0;
+            goto out;
+        }
+    }
+    fprintf(stderr, "mime_map_build: не удалось построить хеш-функцию\n");
+out:
+    if (ret == -1) {
+        free(map->slots);
+        map->slots = NULL;
+    }
+    free(hashes);
+    free(order);
+    free(start);
+    free(buckets);
+    return ret;
+}
+
+const struct mime_type *mime_lookup(const struct mime_map *map,
+    const char *path) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const char *dot = strrchr(base, '.');
+    if (!dot || !map->slots)
+        return &map->fallback;
+    dot++;
+
+    /* приведение к нижнему регистру (только ASCII) вместе с хешем */
+    char ext[MIME_MAX_EXT];
+    size_t len = 0;
+    uint64_t h = 14695981039346656037ULL;
+    for (; dot[len] != '\0'; len++) {
+        if (len == MIME_MAX_EXT)
+            return &map->fallback;
+        char c = dot[len];
+        if (c >= 'A' && c <= 'Z')
+            c = (char)(c - 'A' + 'a');
+        ext[len] = c;
+        h ^= (unsigned char)c;
+        h *= 1099511628211ULL;
+    }
+    const uint32_t d = map->displace[h & map->bucket_mask];
+    const int32_t i = map->slots[displace_hash(h, d) & map->slot_mask];
+    if (i < 0)
+        return &map->fallback;
+    const struct mime_entry *e = &map->entries[i];
+    if (e->ext_len != len || memcmp(e->ext, ext, len) != 0)
+        return &map->fallback;
+    return e->type;
+}
+
+void mime_map_destroy(struct mime_map *map) {
+    for (size_t i = 0; i < map->ntypes; i++) {
+        free((char *)map->types[i]->name);
+        free(map->types[i]);
+    }
+    free(map->types);
+    free(map->entries);
+    free(map->displace);
+    free(map->slots);
+    memset(map, 0, sizeof(*map));
+}
@@ -0,0 +1,83 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MIME_MAX_EXT 16 /* расширения длиннее не учитываются */
+#define MIME_MAX_TYPE 127 /* строки с типом длиннее пропускаются */
+#define MIME_DEFAULT_TYPE "application/octet-stream"
+
+/* MIME-тип. compressible вычисляется один раз при добавлении: для таких
+ * типов ищутся сжатые копии и отдаётся Vary: Accept-Encoding */
+struct mime_type {
+    const char *name;
+    bool compressible;
+};
+
+struct mime_entry {
+    char ext[MIME_MAX_EXT];
+    size_t ext_len;
+    const struct mime_type *type;
+};
+
+/* Таблица расширений. После mime_map_build поиск идёт по совершенной
+ * хеш-функции: корзина по первому хешу даёт смещение, а смещение —
+ * единственный слот, так что на расширение приходится одно сравнение */
+struct mime_map {
+    struct mime_entry *entries;
+    size_t count;
+    size_t capacity;
+    struct mime_type **types;
+    size_t ntypes;
+    uint32_t *displace; /* смещение для каждой корзины */
+    size_t bucket_mask;
+    int32_t *slots; /* индекс в entries или -1 */
+    size_t slot_mask;
+    struct mime_type fallback;
+};
+
+/**
+ * Инициализация таблицы встроенными типами (html, css, js, картинки,
+ * pdf)
+ * @param map
+ * @return
+ */
+int mime_map_init(struct mime_map *map);
+
+/**
+ * Загрузка файла в формате mime.types: на строке тип и его расширения,
+ * # начинает комментарий. Расширения из файла заменяют встроенные.
+ * Строки с типом длиннее MIME_MAX_TYPE пропускаются: тип попадает в
+ * заготовку заголовка ответа фиксированного размера
+ * @param map
+ * @param path
+ * @return
+ */
+int mime_map_load(struct mime_map *map, const char *path);
+
+/**
+ * Построение совершенной хеш-функции по всем добавленным расширениям.
+ * После этого таблица только читается и может быть общей для воркеров
+ * @param map
+ * @return
+ */
+int mime_map_build(struct mime_map *map);
+
+/**
+ * MIME-тип по расширению последнего компонента пути, регистр не важен
+ * @param map
+ * @param path
+ * @return тип, для неизвестных расширений application/octet-stream
+ */
+const struct mime_type *mime_lookup(const struct mime_map *map,
+    const char *path);
+
+/**
+ * Освобождение таблицы
+ * @param map
+ */
+void mime_map_destroy(struct mime_map *map);
+
+#endif /* MIME_H */
@@ -0,0 +1,366 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#define MAX_THREADS 256
+
+/* Список файлов и позиция следующего необработанного */
+typedef struct {
+    pthread_mutex_t mutex;
+    char **files;
+    size_t count;
+    size_t capacity;
+    size_t next;
+} FileQueue;
+
+static struct {
+    unsigned long written;
+    unsigned long skipped;
+    unsigned long failed;
+    pthread_mutex_t mutex;
+} stats = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static void count_result(unsigned long *counter) {
+    pthread_mutex_lock(&stats.mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&stats.mutex);
+}
+
+/**
+ * Те же текстовые типы, для которых сервер ищет сжатые копии
+ * @param name
+ * @return
+ */
+static bool is_compressible(const char *name) {
+    static const char *exts[] = {
+        ".html", ".htm", ".txt", ".css", ".js", ".json", ".svg"
+    };
+    const char *ext = strrchr(name, '.');
+    if (!ext) return false;
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        if (strcmp(ext, exts[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+static int queue_push(FileQueue *q, char *path) {
+    if (q->count == q->capacity) {
+        size_t capacity = q->capacity ? q->capacity * 2 : 64;
+        char **tmp = realloc(q->files, capacity * sizeof(char *));
+        if (!tmp) {
+            perror("queue_push: realloc");
+            return -1;
+        }
+        q->files = tmp;
+        q->capacity = capacity;
+    }
+    q->files[q->count] = path;
+    q->count++;
+    return 0;
+}
+
+/**
+ * Рекурсивный обход каталога
+ * @param q
+ * @param dir_path
+ * @return
+ */
+static int collect_files(FileQueue *q, const char *dir_path) {
+    DIR *d = opendir(dir_path);
+    if (!d) {
+        perror(dir_path);
+        return -1;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        char path[PATH_MAX];
+        int written = snprintf(path, sizeof(path), "%s/%s", dir_path,
+            ent->d_name);
+        if (written < 0 || (size_t)written >= sizeof(path))
+            continue;
+        struct stat st;
+        if (lstat(path, &st) == -1)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            collect_files(q, path);
+        } else if (S_ISREG(st.st_mode) && is_compressible(ent->d_name)) {
+            char *copy = strdup(path);
+            if (!copy || queue_push(q, copy) == -1) {
+                free(copy);
+                closedir(d);
+                return -1;
+            }
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+/**
+ * Запись сжатой копии через временный файл и rename, чтобы сервер
+ * не увидел файл наполовину записанным
+ * @param path
+ * @param data
+ * @param len
+ * @return
+ */
+static int write_sidecar(const char *path, const void *data, size_t len) {
+    char tmp_path[PATH_MAX];
+    int written = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (written < 0 || (size_t)written >= sizeof(tmp_path))
+        return -1;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(tmp_path);
+        return -1;
+    }
+    const char *p = data;
+    while (len > 0) {
+        ssize_t nw = write(fd, p, len);
+        if (nw < 0) {
+            if (errno == EINTR) continue;
+            perror(tmp_path);
+            close(fd);
+            unlink(tmp_path);
+            return -1;
+        }
+        p += nw;
+        len -= (size_t)nw;
+    }
+    if (close(fd) == -1 || rename(tmp_path, path) == -1) {
+        perror(path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Сжатие в формате gzip
+ * @param src
+ * @param src_len
+ * @param out_len
+ * @return буфер со сжатыми данными или NULL
+ */
+static unsigned char *compress_gzip(const unsigned char *src, size_t src_len,
+    size_t *out_len) {
+    z_stream zs = {0};
+    /* 15 + 16: окно 32 КБ и заголовок gzip вместо zlib */
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    uLong bound = deflateBound(&zs, (uLong)src_len);
+    unsigned char *out = malloc(bound);
+    if (!out) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = (uInt)src_len;
+    zs.next_out = out;
+    zs.avail_out = (uInt)bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+#ifdef HAVE_BROTLI
+static unsigned char *compress_brotli(const unsigned char *src,
+    size_t src_len, size_t *out_len) {
+    size_t bound = BrotliEncoderMaxCompressedSize(src_len);
+    if (bound == 0)
+        return NULL;
+    unsigned char *out = malloc(bound);
+    if (!out)
+        return NULL;
+    *out_len = bound;
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+        BROTLI_MODE_TEXT, src_len, src, out_len, out)) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+/**
+ * Создание одной сжатой копии, если её нет или она старше исходника.
+ * Копия, которая не меньше исходника, не нужна и удаляется
+ * @param path
+ * @param st
+ * @param src
+ * @param suffix
+ * @param compress
+ */
+static void make_sidecar(const char *path, const struct stat *st,
+    const unsigned char *src, const char *suffix,
+    unsigned char *(*compress)(const unsigned char *, size_t, size_t *)) {
+    char sidecar[PATH_MAX];
+    int written = snprintf(sidecar, sizeof(sidecar), "%s%s", path, suffix);
+    if (written < 0 || (size_t)written >= sizeof(sidecar)) {
+        count_result(&stats.failed);
+        return;
+    }
+
+    struct stat sst;
+    if (stat(sidecar, &sst) == 0 && sst.st_mtime >= st->st_mtime) {
+        count_result(&stats.skipped);
+        return;
+    }
+
+    size_t out_len = 0;
+    unsigned char *out = compress(src, (size_t)st->st_size, &out_len);
+    if (!out) {
+        fprintf(stderr, "%s: ошибка сжатия\n", sidecar);
+        count_result(&stats.failed);
+        return;
+    }
+    if (out_len >= (size_t)st->st_size) {
+        unlink(sidecar);
+        count_result(&stats.skipped);
+    } else if (write_sidecar(sidecar, out, out_len) == 0) {
+        count_result(&stats.written);
+    } else {
+        count_result(&stats.failed);
+    }
+    free(out);
+}
+
+static void process_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        count_result(&stats.failed);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    unsigned char *src = mmap(NULL, (size_t)st.st_size, PROT_READ,
+        MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (src == MAP_FAILED) {
+        perror(path);
+        count_result(&stats.failed);
+        return;
+    }
+
+    make_sidecar(path, &st, src, ".gz", compress_gzip);
+#ifdef HAVE_BROTLI
+    make_sidecar(path, &st, src, ".br", compress_brotli);
+#endif
+    munmap(src, (size_t)st.st_size);
+}
+
+/**
+ * Поток воркера: берёт файлы из очереди, пока они не кончатся
+ * @param arg
+ * @return
+ */
+static void *worker(void *arg) {
+    FileQueue *q = arg;
+    while (1) {
+        pthread_mutex_lock(&q->mutex);
+        if (q->next >= q->count) {
+            pthread_mutex_unlock(&q->mutex);
+            break;
+        }
+        const char *path = q->files[q->next];
+        q->next++;
+        pthread_mutex_unlock(&q->mutex);
+
+        process_file(path);
+    }
+    return NULL;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Использование: %s -d <директория> [-t <число потоков>]\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *root_dir = NULL;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads <= 0)
+        num_threads = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:t:")) != -1) {
+        switch (opt) {
+            case 'd':
+                root_dir = optarg;
+                break;
+            case 't': {
+                char *end;
+                errno = 0;
+                long val = strtol(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || val <= 0 ||
+                    val > MAX_THREADS) {
+                    fprintf(stderr, "Неверное число потоков '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                num_threads = val;
+                break;
+            }
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (!root_dir) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    FileQueue queue = {0};
+    pthread_mutex_init(&queue.mutex, NULL);
+    if (collect_files(&queue, root_dir) == -1 && queue.count == 0)
+        exit(EXIT_FAILURE);
+
+    pthread_t threads[MAX_THREADS];
+    for (long i = 0; i < num_threads; i++) {
+        errno = pthread_create(&threads[i], NULL, worker, &queue);
+        if (errno != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (long i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    printf("Файлов: %zu, записано копий: %lu, пропущено: %lu, ошибок: %lu\n",
+        queue.count, stats.written, stats.skipped, stats.failed);
+
+    for (size_t i = 0; i < queue.count; i++)
+        free(queue.files[i]);
+    free(queue.files);
+    pthread_mutex_destroy(&queue.mutex);
+
+    exit(stats.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
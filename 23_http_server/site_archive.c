@@ -0,0 +1,289 @@
+#include "site_archive.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "zip.h"
+
+/* 2 байта заголовка zlib и 4 байта Adler-32 вокруг сжатых данных */
+#define ZLIB_FRAMING 6
+
+static uint64_t hash_name(const char *name, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#ifdef HAVE_ZLIB
+/**
+ * Распаковка участника блоками с проверкой размера и CRC-32 и подсчётом
+ * Adler-32 для хвоста потока zlib
+ * @param m
+ * @param data
+ * @param comp_size
+ * @param crc
+ * @return false, если данные повреждены
+ */
+static bool check_deflated(struct site_member *m, const uint8_t *data,
+    size_t comp_size, uint32_t crc) {
+    unsigned char out[64 * 1024];
+    z_stream zs = {0};
+    /* отрицательное окно: «сырой» deflate без заголовка zlib, как в zip */
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+        return false;
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)comp_size;
+    uLong crc_out = crc32(0L, Z_NULL, 0);
+    uLong adler = adler32(0L, Z_NULL, 0);
+    int ret;
+    do {
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        const uInt n = (uInt)(sizeof(out) - zs.avail_out);
+        crc_out = crc32(crc_out, out, n);
+        adler = adler32(adler, out, n);
+    } while (ret == Z_OK);
+    const bool ok = ret == Z_STREAM_END &&
+        zs.total_out == m->identity.size && crc_out == crc;
+    inflateEnd(&zs);
+    m->adler = (uint32_t)adler;
+    return ok;
+}
+#endif
+
+/**
+ * Заготовка заголовка участника
+ * @param e
+ * @param mime
+ * @param vary
+ * @return -1, если заголовок не поместился (сообщение выведено)
+ */
+static int set_header(struct file_entry *e, const char *mime, bool vary) {
+    if (file_entry_set_header(e, mime, vary))
+        return 0;
+    fprintf(stderr, "%s: заголовок ответа не помещается\n", e->path);
+    return -1;
+}
+
+/**
+ * Заполнение записей участника по данным центрального каталога
+ * @param archive
+ * @param m
+ * @param zm
+ * @param mime_type
+ * @return
+ */
+static int add_member(struct site_archive *archive, struct site_member *m,
+    const zipmemb_t *zm, const char *(*mime_type)(const char *)) {
+    struct file_entry *e = &m->identity;
+    e->path = strndup((const char *)zm->name, zm->name_len);
+    if (!e->path)
+        return -1;
+    e->hash = hash_name(e->path, zm->name_len);
+    e->size = zm->uncomp_size;
+    e->mtime = zm->mtime;
+    m->data = zm->comp_data;
+    m->data_len = zm->comp_size;
+    /* ETag из CRC-32 и размера: архив не меняется, пока сервер работает */
+    snprintf(e->etag, sizeof(e->etag), "\"%08lx-%zx\"",
+        (unsigned long)zm->crc32, e->size);
+
+    const char *mime = mime_type(e->path);
+    if (zm->method == ZIP_STORED) {
+        e->fd = archive->fd;
+        e->offset = (off_t)(zm->comp_data - archive->map);
+        return set_header(e, mime, false);
+    }
+
+#ifdef HAVE_ZLIB
+    if (!check_deflated(m, zm->comp_data, zm->comp_size, zm->crc32)) {
+        fprintf(stderr, "%s: повреждён сжатый участник\n", e->path);
+        return -1;
+    }
+#else
+    fprintf(stderr, "%s: сжатый участник, а сервер собран без zlib\n",
+        e->path);
+    return -1;
+#endif
+    e->fd = -1;
+    if (set_header(e, mime, true) == -1)
+        return -1;
+    /* повторная распаковка только при открытии, зато не на каждый запрос */
+    if (e->size <= SITE_ARCHIVE_CACHE_MEM - archive->inflated_mem) {
+        e->data = site_archive_inflate(m);
+        if (!e->data) {
+            perror("site_archive_open");
+            return -1;
+        }
+        e->in_memory = true;
+        archive->inflated_mem += e->size;
+    }
+
+    struct file_entry *d = &m->deflated;
+    d->path = e->path;
+    d->encoding = FILE_ENC_DEFLATE;
+    d->hash = e->hash;
+    d->fd = archive->fd;
+    d->offset = (off_t)(zm->comp_data - archive->map);
+    d->size = zm->comp_size + ZLIB_FRAMING;
+    d->mtime = e->mtime;
+    snprintf(d->etag, sizeof(d->etag), "\"%08lx-%zx-deflate\"",
+        (unsigned long)zm->crc32, e->size);
+    return set_header(d, mime, true);
+}
+
+/**
+ * Индекс имён: таблица с открытой адресацией не меньше чем вдвое больше
+ * числа участников. При повторе имени остаётся первый участник
+ * @param archive
+ * @return
+ */
+static int build_index(struct site_archive *archive) {
+    size_t size = 16;
+    while (size < archive->count * 2)
+        size *= 2;
+    archive->index = calloc(size, sizeof(*archive->index));
+    if (!archive->index)
+        return -1;
+    archive->index_mask = size - 1;
+    for (size_t i = 0; i < archive->count; i++) {
+        struct site_member *m = &archive->members[i];
+        size_t slot = m->identity.hash & archive->index_mask;
+        bool duplicate = false;
+        while (archive->index[slot]) {
+            if (strcmp(archive->index[slot]->identity.path,
+                m->identity.path) == 0) {
+                duplicate = true;
+                break;
+            }
+            slot = (slot + 1) & archive->index_mask;
+        }
+        if (!duplicate)
+            archive->index[slot] = m;
+    }
+    return 0;
+}
+
+int site_archive_open(struct site_archive *archive, const char *path,
+    const char *(*mime_type)(const char *name)) {
+    memset(archive, 0, sizeof(*archive));
+    archive->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (archive->fd == -1) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(archive->fd, &st) == -1) {
+        perror(path);
+        goto error;
+    }
+    archive->map_len = (size_t)st.st_size;
+    if (archive->map_len > 0) {
+        archive->map = mmap(NULL, archive->map_len, PROT_READ, MAP_SHARED,
+            archive->fd, 0);
+        if (archive->map == MAP_FAILED) {
+            archive->map = NULL;
+            perror(path);
+            goto error;
+        }
+    }
+
+    zip_t zip;
+    if (!archive->map || !zip_read(&zip, archive->map, archive->map_len)) {
+        fprintf(stderr, "%s: не удалось разобрать zip-архив\n", path);
+        goto error;
+    }
+    archive->members = calloc(zip.num_members ? zip.num_members : 1,
+        sizeof(*archive->members));
+    if (!archive->members) {
+        perror("site_archive_open");
+        goto error;
+    }
+
+    zipmemb_t zm;
+    for (zipiter_t it = zip.members_begin; it != zip.members_end;
+        it = zm.next) {
+        zm = zip_member(&zip, it);
+        if (zm.is_dir || (zm.name_len > 0 && zm.name[zm.name_len - 1] == '/'))
+            continue;
+        if (add_member(archive, &archive->members[archive->count], &zm,
+            mime_type) == -1) {
+            free(archive->members[archive->count].identity.path);
+            free(archive->members[archive->count].identity.data);
+            goto error;
+        }
+        archive->count++;
+    }
+    if (build_index(archive) == -1) {
+        perror("site_archive_open");
+        goto error;
+    }
+    return 0;
+error:
+    site_archive_close(archive);
+    return -1;
+}
+
+const struct site_member *site_archive_find(
+    const struct site_archive *archive, const char *path) {
+    while (*path == '/')
+        path++;
+    const size_t len = strlen(path);
+    size_t slot = hash_name(path, len) & archive->index_mask;
+    while (archive->index[slot]) {
+        const struct site_member *m = archive->index[slot];
+        if (strcmp(m->identity.path, path) == 0)
+            return m;
+        slot = (slot + 1) & archive->index_mask;
+    }
+    return NULL;
+}
+
+char *site_archive_inflate(const struct site_member *member) {
+    char *out = malloc(member->identity.size ? member->identity.size : 1);
+    if (!out)
+        return NULL;
+#ifdef HAVE_ZLIB
+    z_stream zs = {0};
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)member->data;
+    zs.avail_in = (uInt)member->data_len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = (uInt)member->identity.size;
+    const int ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret == Z_STREAM_END && zs.total_out == member->identity.size)
+        return out;
+#endif
+    free(out);
+    return NULL;
+}
+
+void site_archive_close(struct site_archive *archive) {
+    for (size_t i = 0; i < archive->count; i++) {
+        free(archive->members[i].identity.path);
+        free(archive->members[i].identity.data);
+    }
+    free(archive->members);
+    free(archive->index);
+    if (archive->map)
+        munmap(archive->map, archive->map_len);
+    if (archive->fd != -1)
+        close(archive->fd);
+    memset(archive, 0, sizeof(*archive));
+    archive->fd = -1;
+}
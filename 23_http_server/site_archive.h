@@ -0,0 +1,76 @@
+#ifndef SITE_ARCHIVE_H
+#define SITE_ARCHIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_cache.h"
+
+/* Распакованные при открытии сжатые участники, в сумме */
+#define SITE_ARCHIVE_CACHE_MEM (64 * 1024 * 1024)
+
+/* Участник архива. identity описывает содержимое как есть: у несжатого
+ * участника оно лежит в файле архива, у сжатого fd == -1, и содержимое
+ * либо распаковано при открытии (in_memory, data), либо распаковывается
+ * на запрос. deflated есть только у сжатых участников (size > 0): это
+ * поток zlib из сжатых данных архива, к которым при отправке добавляются
+ * 2 байта заголовка и 4 байта Adler-32 */
+struct site_member {
+    struct file_entry identity;
+    struct file_entry deflated;
+    const uint8_t *data; /* данные участника в отображении архива */
+    size_t data_len;
+    uint32_t adler; /* Adler-32 распакованного содержимого */
+};
+
+/* Архив сайта, отображённый в память целиком. После открытия только
+ * читается, поэтому общий для всех воркеров */
+struct site_archive {
+    int fd;
+    uint8_t *map;
+    size_t map_len;
+    struct site_member *members;
+    size_t count;
+    struct site_member **index; /* открытая адресация по имени */
+    size_t index_mask;
+    size_t inflated_mem; /* распаковано в память при открытии */
+};
+
+/**
+ * Открытие zip-архива, разбор центрального каталога и построение индекса
+ * имён. Сжатые участники распаковываются один раз для проверки CRC-32 и
+ * подсчёта Adler-32 и, пока хватает SITE_ARCHIVE_CACHE_MEM, остаются в
+ * памяти; без zlib архив с ними не открывается
+ * @param archive
+ * @param path
+ * @param mime_type MIME-тип по имени участника
+ * @return
+ */
+int site_archive_open(struct site_archive *archive, const char *path,
+    const char *(*mime_type)(const char *name));
+
+/**
+ * Поиск участника по декодированному пути запроса
+ * @param archive
+ * @param path Путь с ведущим '/'
+ * @return участник или NULL
+ */
+const struct site_member *site_archive_find(
+    const struct site_archive *archive, const char *path);
+
+/**
+ * Распаковка сжатого участника, не оставшегося в памяти, для клиента, не
+ * принимающего deflate
+ * @param member
+ * @return буфер размером identity.size (освобождается free) или NULL
+ */
+char *site_archive_inflate(const struct site_member *member);
+
+/**
+ * Снятие отображения и закрытие архива
+ * @param archive
+ */
+void site_archive_close(struct site_archive *archive);
+
+#endif /* SITE_ARCHIVE_H */
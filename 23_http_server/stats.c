@@ -0,0 +1,182 @@
+#include "stats.h"
+#include <stddef.h>
+#include <time.h>
+
+static const int status_codes[STATS_STATUS_COUNT] = {
+    [STATS_200] = 200,
+    [STATS_206] = 206,
+    [STATS_304] = 304,
+    [STATS_400] = 400,
+    [STATS_403] = 403,
+    [STATS_404] = 404,
+    [STATS_405] = 405,
+    [STATS_413] = 413,
+    [STATS_414] = 414,
+    [STATS_416] = 416,
+    [STATS_500] = 500,
+    [STATS_OTHER] = 0
+};
+
+uint64_t stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static enum stats_status status_index(int code) {
+    for (int i = 0; i < STATS_OTHER; i++) {
+        if (status_codes[i] == code)
+            return (enum stats_status)i;
+    }
+    return STATS_OTHER;
+}
+
+/**
+ * Номер интервала гистограммы: значения меньше 8 мкс точные, дальше
+ * старший бит задаёт степень двойки, а следующие 3 бита — интервал в ней
+ * @param us
+ * @return
+ */
+static unsigned latency_bucket(uint64_t us) {
+    if (us < STATS_SUB_BUCKETS)
+        return (unsigned)us;
+    const unsigned e = 63 - (unsigned)__builtin_clzll(us);
+    const unsigned sub = (unsigned)(us >> (e - STATS_SUB_BITS)) &
+        (STATS_SUB_BUCKETS - 1);
+    const unsigned idx = (e - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + sub;
+    return idx < STATS_LATENCY_BUCKETS ? idx : STATS_LATENCY_BUCKETS - 1;
+}
+
+/**
+ * Наибольшее значение, попадающее в интервал
+ * @param idx
+ * @return
+ */
+static uint64_t bucket_upper(unsigned idx) {
+    if (idx < STATS_SUB_BUCKETS)
+        return idx;
+    const unsigned e = idx / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    const uint64_t sub = idx % STATS_SUB_BUCKETS;
+    const unsigned shift = e - STATS_SUB_BITS;
+    return ((STATS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void stats_count_request(struct worker_stats *s, int code,
+    uint64_t latency_us) {
+    stats_add(&s->requests[status_index(code)], 1);
+    stats_add(&s->latency[latency_bucket(latency_us)], 1);
+    stats_add(&s->latency_sum, latency_us);
+}
+
+static void render_counter(FILE *out, const char *name, const char *help,
+    const char *type, const struct worker_stats *const *workers, int n,
+    size_t offset) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (int i = 0; i < n; i++) {
+        const stats_counter *c = (const stats_counter *)
+            ((const char *)workers[i] + offset);
+        fprintf(out, "%s{worker=\"%d\"} %llu\n", name, i,
+            (unsigned long long)stats_get(c));
+    }
+}
+
+void stats_render(FILE *out, const struct worker_stats *const *workers,
+    const struct cache_stats *const *caches, int n) {
+    render_counter(out, "http_accepts_total", "Accepted connections.",
+        "counter", workers, n, offsetof(struct worker_stats, accepts));
+
+    render_counter(out, "http_accept_rejects_total",
+        "Accepted sockets closed without service and accept() failures on"
+        " descriptor exhaustion.", "counter", workers, n,
+        offsetof(struct worker_stats, accept_rejects));
+    render_counter(out, "http_accept_pauses_total",
+        "Times the listener was disabled at the connection limit.",
+        "counter", workers, n, offsetof(struct worker_stats, accept_pauses));
+
+    fprintf(out, "# HELP http_connections_active Open connections.\n"
+                 "# TYPE http_connections_active gauge\n");
+    for (int i = 0; i < n; i++) {
+        /* закрытия читаются первыми, чтобы разность не ушла в минус */
+        const uint64_t closes = stats_get(&workers[i]->closes);
+        const uint64_t accepts = stats_get(&workers[i]->accepts);
+        fprintf(out, "http_connections_active{worker=\"%d\"} %llu\n", i,
+            (unsigned long long)(accepts > closes ? accepts - closes : 0));
+    }
+
+    render_counter(out, "http_sent_bytes_total", "Bytes written to sockets.",
+        "counter", workers, n, offsetof(struct worker_stats, bytes_sent));
+
+    render_counter(out, "http_access_log_dropped_total",
+        "Access log records lost on ring overflow.", "counter", workers, n,
+        offsetof(struct worker_stats, log_dropped));
+
+    fprintf(out, "# HELP http_requests_total Completed responses by status.\n"
+                 "# TYPE http_requests_total counter\n");
+    for (int i = 0; i < n; i++) {
+        for (int s = 0; s < STATS_STATUS_COUNT; s++) {
+            const uint64_t v = stats_get(&workers[i]->requests[s]);
+            if (v == 0)
+                continue;
+            if (s == STATS_OTHER)
+                fprintf(out, "http_requests_total{worker=\"%d\","
+                             "code=\"other\"} %llu\n", i,
+                    (unsigned long long)v);
+            else
+                fprintf(out, "http_requests_total{worker=\"%d\","
+                             "code=\"%d\"} %llu\n", i, status_codes[s],
+                    (unsigned long long)v);
+        }
+    }
+
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } cache_metrics[] = {
+        { "http_file_cache_hits_total", "File cache hits.",
+          offsetof(struct cache_stats, hits) },
+        { "http_file_cache_memory_hits_total",
+          "File cache hits served from memory.",
+          offsetof(struct cache_stats, mem_hits) },
+        { "http_file_cache_misses_total", "File cache misses.",
+          offsetof(struct cache_stats, misses) },
+    };
+    for (size_t m = 0; m < sizeof(cache_metrics) / sizeof(cache_metrics[0]);
+         m++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n",
+            cache_metrics[m].name, cache_metrics[m].help,
+            cache_metrics[m].name);
+        for (int i = 0; i < n; i++) {
+            const stats_counter *c = (const stats_counter *)
+                ((const char *)caches[i] + cache_metrics[m].offset);
+            fprintf(out, "%s{worker=\"%d\"} %llu\n", cache_metrics[m].name,
+                i, (unsigned long long)stats_get(c));
+        }
+    }
+
+    /* пустые интервалы не выводятся, накопленные значения от этого не
+     * меняются */
+    fprintf(out, "# HELP http_request_duration_seconds Time from accept or"
+                 " request start to the last byte of the response.\n"
+                 "# TYPE http_request_duration_seconds histogram\n");
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    for (unsigned b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+        uint64_t v = 0;
+        for (int i = 0; i < n; i++)
+            v += stats_get(&workers[i]->latency[b]);
+        if (v == 0)
+            continue;
+        total += v;
+        fprintf(out, "http_request_duration_seconds_bucket{le=\"%.6f\"}"
+                     " %llu\n", (double)bucket_upper(b) / 1e6,
+            (unsigned long long)total);
+    }
+    for (int i = 0; i < n; i++)
+        sum += stats_get(&workers[i]->latency_sum);
+    fprintf(out, "http_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+                 "http_request_duration_seconds_sum %.6f\n"
+                 "http_request_duration_seconds_count %llu\n",
+        (unsigned long long)total, (double)sum / 1e6,
+        (unsigned long long)total);
+}
@@ -0,0 +1,92 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Гистограмма задержек в стиле HDR: на каждую степень двойки микросекунд
+ * приходится 8 интервалов, относительная погрешность не больше 12,5% */
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_LATENCY_BUCKETS (STATS_SUB_BUCKETS * 36)
+
+/* Коды ответов, для которых ведутся отдельные счётчики */
+enum stats_status {
+    STATS_200,
+    STATS_206,
+    STATS_304,
+    STATS_400,
+    STATS_403,
+    STATS_404,
+    STATS_405,
+    STATS_413,
+    STATS_414,
+    STATS_416,
+    STATS_500,
+    STATS_OTHER,
+    STATS_STATUS_COUNT
+};
+
+typedef _Atomic uint64_t stats_counter;
+
+/* Счётчик пишет только поток его воркера, поэтому достаточно
+ * relaxed-чтения и записи без атомарного сложения. Другие потоки
+ * только читают его при выдаче статистики */
+static inline void stats_add(stats_counter *c, uint64_t n) {
+    atomic_store_explicit(c,
+        atomic_load_explicit(c, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+static inline uint64_t stats_get(const stats_counter *c) {
+    return atomic_load_explicit((stats_counter *)c, memory_order_relaxed);
+}
+
+/* Счётчики воркера */
+struct worker_stats {
+    stats_counter accepts;
+    stats_counter accept_rejects;
+    stats_counter accept_pauses;
+    stats_counter closes;
+    stats_counter bytes_sent;
+    stats_counter log_dropped;
+    stats_counter requests[STATS_STATUS_COUNT];
+    stats_counter latency[STATS_LATENCY_BUCKETS];
+    stats_counter latency_sum; /* мкс */
+};
+
+/* Счётчики кэша файлов воркера */
+struct cache_stats {
+    stats_counter hits;
+    stats_counter mem_hits;
+    stats_counter misses;
+};
+
+/**
+ * Монотонное время в микросекундах
+ * @return
+ */
+uint64_t stats_now_us(void);
+
+/**
+ * Учёт завершённого ответа
+ * @param s
+ * @param code
+ * @param latency_us
+ */
+void stats_count_request(struct worker_stats *s, int code,
+    uint64_t latency_us);
+
+/**
+ * Вывод счётчиков всех воркеров в текстовом формате Prometheus.
+ * Гистограмма задержек суммируется по воркерам
+ * @param out
+ * @param workers
+ * @param caches
+ * @param n
+ */
+void stats_render(FILE *out, const struct worker_stats *const *workers,
+    const struct cache_stats *const *caches, int n);
+
+#endif /* STATS_H */
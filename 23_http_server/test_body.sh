@@ -0,0 +1,64 @@
+#!/bin/bash
+# Проверка запросов с телом: байты тела не должны разбираться как
+# следующий запрос (подмена запроса при pipelining). Тело по Content-Length
+# пропускается, после тела chunked соединение закрывается.
+# Использование: test_body.sh <23_http_server>
+# Переменные: TEST_PORT
+
+SERVER=${1:-./23_http_server}
+PORT=${TEST_PORT:-18081}
+
+ROOT=$(mktemp -d) || exit 1
+PID=
+cleanup() {
+	[ -n "$PID" ] && kill "$PID" 2>/dev/null
+	rm -rf "$ROOT"
+}
+trap cleanup EXIT
+
+echo hello > "$ROOT/index.html"
+
+"$SERVER" -d "$ROOT" -l "127.0.0.1:$PORT" -w 1 &
+PID=$!
+sleep 1
+if ! kill -0 "$PID" 2>/dev/null; then
+	echo "Сервер не запустился" >&2
+	PID=
+	exit 1
+fi
+
+# закрытие соединения до конца записи не должно прерывать проверку
+trap '' PIPE
+
+# Отправка запросов одним пакетом; ответы читаются до закрытия соединения
+# $1 — запросы, $2 — ожидаемые коды ответов через пробел
+FAILED=0
+check() {
+	local statuses
+	local data
+	printf -v data '%b' "$1"
+	exec 3<>"/dev/tcp/127.0.0.1/$PORT" || exit 1
+	echo -n "$data" >&3
+	# тела ответов об ошибках без перевода строки, статус может идти сразу
+	# за ними
+	statuses=$(cat <&3 | grep -ao 'HTTP/1\.[01] [0-9][0-9][0-9]' |
+		cut -d' ' -f2 | tr '\n' ' ')
+	exec 3<&-
+	if [ "${statuses% }" != "$2" ]; then
+		echo "FAIL: ожидалось '$2', получено '${statuses% }'" >&2
+		FAILED=1
+	else
+		echo "ok: $2"
+	fi
+}
+
+# тело по Content-Length пропускается, следующий запрос разбирается
+check 'POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\n\r\nhelloGET /index.html HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n' '405 200'
+check 'GET /index.html HTTP/1.1\r\nHost: a\r\nContent-Length: 28\r\n\r\nGET /index.html HTTP/1.1\r\n\r\nGET /index.html HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n' '200 200'
+# тело chunked не читается: ответ и закрытие соединения
+check 'POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\nGET /index.html HTTP/1.1\r\nHost: a\r\n\r\n' '405'
+# неоднозначная длина тела
+check 'POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\nhello' '400'
+check 'GET /index.html HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\nContent-Length: 0\r\n\r\nhello' '400'
+check 'GET /index.html HTTP/1.1\r\nHost: a\r\nContent-Length: -1\r\n\r\n' '400'
+exit $FAILED
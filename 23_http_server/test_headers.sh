@@ -0,0 +1,113 @@
+#!/bin/bash
+# Проверка заголовков ответов на запросы диапазонов и условные запросы:
+# Range с одним диапазоном, неудовлетворимый диапазон (416 с
+# Content-Range: bytes */размер), несколько диапазонов (весь файл, 200) и
+# 304 с Vary для файла со сжатой копией.
+# Использование: test_headers.sh <23_http_server>
+# Переменные: TEST_PORT
+
+SERVER=${1:-./23_http_server}
+PORT=${TEST_PORT:-18082}
+
+ROOT=$(mktemp -d) || exit 1
+PID=
+cleanup() {
+	[ -n "$PID" ] && kill "$PID" 2>/dev/null
+	rm -rf "$ROOT"
+}
+trap cleanup EXIT
+
+printf '0123456789' > "$ROOT/digits.txt"
+echo '<p>hello</p>' > "$ROOT/page.html"
+gzip -c "$ROOT/page.html" > "$ROOT/page.html.gz"
+printf 'PNG' > "$ROOT/image.png"
+
+"$SERVER" -d "$ROOT" -l "127.0.0.1:$PORT" -w 1 &
+PID=$!
+sleep 1
+if ! kill -0 "$PID" 2>/dev/null; then
+	echo "Сервер не запустился" >&2
+	PID=
+	exit 1
+fi
+
+# закрытие соединения до конца чтения не должно прерывать проверку
+trap '' PIPE
+
+# Отправка запроса и чтение заголовков ответа в HEADERS, без \r
+# $1 — путь, $2 — дополнительные заголовки запроса
+request() {
+	local data
+	printf -v data '%b' "GET $1 HTTP/1.1\r\nHost: a\r\n$2Connection: close\r\n\r\n"
+	exec 3<>"/dev/tcp/127.0.0.1/$PORT" || exit 1
+	echo -n "$data" >&3
+	HEADERS=$(cat <&3 2>/dev/null | tr -d '\r' | sed '/^$/q')
+	exec 3<&-
+}
+
+# $1 — путь, $2 — заголовки запроса, $3 — ожидаемый код ответа, далее —
+# строки, которые должны быть среди заголовков ответа. Строка с ! в
+# начале: заголовка с таким именем быть не должно
+FAILED=0
+check() {
+	local path=$1
+	local status=$3
+	local line
+	local got
+	request "$path" "$2"
+	shift 3
+	got=$(head -n 1 <<< "$HEADERS" | cut -d' ' -f2)
+	if [ "$got" != "$status" ]; then
+		echo "FAIL: $path: ожидался код $status, получен '$got'" >&2
+		FAILED=1
+		return
+	fi
+	for line in "$@"; do
+		if [ "${line:0:1}" = "!" ]; then
+			if grep -qi "^${line:1}:" <<< "$HEADERS"; then
+				echo "FAIL: $path $status: лишний заголовок ${line:1}" >&2
+				FAILED=1
+				return
+			fi
+		elif ! grep -qxF "$line" <<< "$HEADERS"; then
+			echo "FAIL: $path $status: нет '$line'" >&2
+			FAILED=1
+			return
+		fi
+	done
+	echo "ok: $path $status $*"
+}
+
+# один байт и суффикс файла
+check /digits.txt 'Range: bytes=0-0\r\n' 206 \
+	'Content-Length: 1' 'Content-Range: bytes 0-0/10'
+check /digits.txt 'Range: bytes=-3\r\n' 206 \
+	'Content-Length: 3' 'Content-Range: bytes 7-9/10'
+check /digits.txt 'Range: bytes=-20\r\n' 206 \
+	'Content-Length: 10' 'Content-Range: bytes 0-9/10'
+# диапазон за концом файла и пустой суффикс
+check /digits.txt 'Range: bytes=10-\r\n' 416 'Content-Range: bytes */10'
+check /digits.txt 'Range: bytes=-0\r\n' 416 'Content-Range: bytes */10'
+# несколько диапазонов не поддерживаются: весь файл
+check /digits.txt 'Range: bytes=0-0,2-3\r\n' 200 \
+	'Content-Length: 10' '!Content-Range'
+
+# 304 повторяет Vary ответа 200 для файла со сжатой копией, и для сжатой
+# копии, и для исходного файла
+request /page.html 'Accept-Encoding: gzip\r\n'
+GZIP_ETAG=$(sed -n 's/^ETag: //p' <<< "$HEADERS")
+request /page.html ''
+ETAG=$(sed -n 's/^ETag: //p' <<< "$HEADERS")
+if [ -z "$GZIP_ETAG" ] || [ "$GZIP_ETAG" = "$ETAG" ]; then
+	echo "FAIL: нет отдельного ETag у сжатой копии" >&2
+	FAILED=1
+fi
+check /page.html "Accept-Encoding: gzip\r\nIf-None-Match: $GZIP_ETAG\r\n" \
+	304 "ETag: $GZIP_ETAG" 'Vary: Accept-Encoding'
+check /page.html "If-None-Match: $ETAG\r\n" 304 \
+	"ETag: $ETAG" 'Vary: Accept-Encoding'
+# несжимаемый тип отдаётся без Vary
+request /image.png ''
+ETAG=$(sed -n 's/^ETag: //p' <<< "$HEADERS")
+check /image.png "If-None-Match: $ETAG\r\n" 304 "ETag: $ETAG" '!Vary'
+exit $FAILED
@@ -0,0 +1,102 @@
+#include "timer_wheel.h"
+#include <string.h>
+#include <time.h>
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now_ms) {
+    memset(tw, 0, sizeof(*tw));
+    tw->tick = now_ms / TIMER_TICK_MS;
+}
+
+static void unlink_timer(struct timer_wheel *tw, struct timer *t) {
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        tw->slots[t->expires % TIMER_WHEEL_SLOTS] = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    t->prev = NULL;
+    t->next = NULL;
+    t->active = false;
+    tw->count--;
+}
+
+static void push_slot(struct timer **slot, struct timer *t) {
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot)
+        (*slot)->prev = t;
+    *slot = t;
+}
+
+void timer_set(struct timer_wheel *tw, struct timer *t, uint64_t now_ms,
+    uint64_t timeout_ms) {
+    if (t->active)
+        unlink_timer(tw, t);
+
+    /* округление вверх: таймер не срабатывает раньше срока */
+    t->expires = (now_ms + timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (t->expires <= tw->tick)
+        t->expires = tw->tick + 1;
+
+    push_slot(&tw->slots[t->expires % TIMER_WHEEL_SLOTS], t);
+    t->active = true;
+    tw->count++;
+}
+
+void timer_cancel(struct timer_wheel *tw, struct timer *t) {
+    if (t->active)
+        unlink_timer(tw, t);
+}
+
+int timer_wheel_timeout(const struct timer_wheel *tw, uint64_t now_ms) {
+    if (tw->count == 0)
+        return -1;
+    const uint64_t next_ms = (tw->tick + 1) * TIMER_TICK_MS;
+    return next_ms > now_ms ? (int)(next_ms - now_ms) : 0;
+}
+
+void timer_wheel_expire(struct timer_wheel *tw, uint64_t now_ms,
+    void (*expire)(struct timer *t, void *arg), void *arg) {
+    const uint64_t now_tick = now_ms / TIMER_TICK_MS;
+    if (now_tick <= tw->tick)
+        return;
+
+    /* после долгого простоя каждый слот достаточно пройти один раз */
+    uint64_t from = tw->tick + 1;
+    if (now_tick - tw->tick > TIMER_WHEEL_SLOTS)
+        from = now_tick - TIMER_WHEEL_SLOTS + 1;
+
+    for (uint64_t tick = from; tick <= now_tick && tw->count > 0; tick++) {
+        struct timer **slot = &tw->slots[tick % TIMER_WHEEL_SLOTS];
+        /* слот целиком переносится в список за заглушкой: у каждого
+         * таймера в нём есть prev, так что снятие или перестановка из
+         * expire корректно вынимает таймер и отсюда. Слот проходится один
+         * раз, не дождавшиеся своего оборота возвращаются в него */
+        struct timer pending = { .next = *slot };
+        if (pending.next)
+            pending.next->prev = &pending;
+        *slot = NULL;
+        struct timer *t;
+        while ((t = pending.next) != NULL) {
+            pending.next = t->next;
+            if (t->next)
+                t->next->prev = &pending;
+            if (t->expires > now_tick) {
+                push_slot(slot, t);
+                continue;
+            }
+            t->prev = NULL;
+            t->next = NULL;
+            t->active = false;
+            tw->count--;
+            expire(t, arg);
+        }
+    }
+    tw->tick = now_tick;
+}
@@ -0,0 +1,78 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_SLOTS 512
+#define TIMER_TICK_MS 250
+
+/* Таймер встраивается в объект-владелец. Постановка, перестановка и
+ * снятие — O(1) */
+struct timer {
+    struct timer *prev;
+    struct timer *next;
+    uint64_t expires; /* номер тика */
+    bool active;
+};
+
+/* Хешированное колесо: таймер лежит в слоте expires % TIMER_WHEEL_SLOTS.
+ * Таймеры дальше одного оборота остаются в слоте до своего тика */
+struct timer_wheel {
+    struct timer *slots[TIMER_WHEEL_SLOTS];
+    uint64_t tick;
+    size_t count;
+};
+
+/**
+ * Монотонное время в миллисекундах
+ * @return
+ */
+uint64_t timer_now_ms(void);
+
+/**
+ * Инициализация колеса
+ * @param tw
+ * @param now_ms
+ */
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now_ms);
+
+/**
+ * Постановка или перестановка таймера
+ * @param tw
+ * @param t
+ * @param now_ms
+ * @param timeout_ms
+ */
+void timer_set(struct timer_wheel *tw, struct timer *t, uint64_t now_ms,
+    uint64_t timeout_ms);
+
+/**
+ * Снятие таймера, если он стоит
+ * @param tw
+ * @param t
+ */
+void timer_cancel(struct timer_wheel *tw, struct timer *t);
+
+/**
+ * Сколько ждать события до следующего тика
+ * @param tw
+ * @param now_ms
+ * @return миллисекунды или -1, если таймеров нет
+ */
+int timer_wheel_timeout(const struct timer_wheel *tw, uint64_t now_ms);
+
+/**
+ * Срабатывание таймеров, чей тик наступил. Просматриваются только слоты
+ * прошедших тиков, каждый за один проход. Таймер снимается до вызова
+ * expire; expire может снимать и переставлять любые таймеры
+ * @param tw
+ * @param now_ms
+ * @param expire
+ * @param arg
+ */
+void timer_wheel_expire(struct timer_wheel *tw, uint64_t now_ms,
+    void (*expire)(struct timer *t, void *arg), void *arg);
+
+#endif /* TIMER_WHEEL_H */